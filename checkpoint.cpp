@@ -0,0 +1,170 @@
+#include "checkpoint.h"
+
+#include "log.h"
+
+#include <set>
+
+#include <sys/stat.h>
+
+namespace NCheckpoint {
+
+namespace {
+
+////////////////////////////////////////////////////////////////////////////////
+
+// "KVMF" in a little-endian file
+constexpr uint32_t manifest_magic = 0x464d564b;
+// 1 had no values file
+constexpr uint32_t manifest_version = 2;
+
+}   // namespace
+
+////////////////////////////////////////////////////////////////////////////////
+
+std::string manifest_path(const std::string& prefix)
+{
+    return prefix + "db.manifest";
+}
+
+std::string partition_path(
+    const std::string& prefix,
+    uint64_t generation,
+    size_t k)
+{
+    return prefix + "db." + std::to_string(generation) + "."
+        + std::to_string(k) + ".bin";
+}
+
+std::string values_path(const std::string& prefix, uint64_t generation)
+{
+    return prefix + "values." + std::to_string(generation) + ".bin";
+}
+
+/*
+ * magic (4) version (4) generation (8) values file (NCodec string)
+ * partition count (4) then per partition: file (NCodec string)
+ * records (8) bytes (8)
+ */
+
+Manifest read_manifest(const std::string& prefix)
+{
+    Manifest manifest;
+    manifest.values = prefix + "values.bin";
+
+    const auto data = NCodec::read_file(manifest_path(prefix));
+    if (data.empty()) {
+        const auto legacy = prefix + "db.bin";
+        struct stat st;
+        if (stat(legacy.c_str(), &st) == 0) {
+            manifest.partitions.push_back({legacy, 0, uint64_t(st.st_size)});
+        }
+        return manifest;
+    }
+
+    std::string_view in = data;
+    uint32_t magic = 0;
+    uint32_t version = 0;
+    uint32_t count = 0;
+    VERIFY(NCodec::Codec<uint32_t>::read(in, magic)
+            && magic == manifest_magic
+            && NCodec::Codec<uint32_t>::read(in, version)
+            && (version == 1 || version == manifest_version)
+            && NCodec::Codec<uint64_t>::read(in, manifest.generation)
+            && (version == 1
+                || NCodec::Codec<std::string>::read(in, manifest.values))
+            && NCodec::Codec<uint32_t>::read(in, count),
+        "invalid checkpoint manifest");
+
+    manifest.partitions.resize(count);
+    for (auto& partition: manifest.partitions) {
+        VERIFY(NCodec::Codec<std::string>::read(in, partition.file)
+                && NCodec::Codec<uint64_t>::read(in, partition.records)
+                && NCodec::Codec<uint64_t>::read(in, partition.bytes),
+            "invalid checkpoint manifest");
+    }
+
+    return manifest;
+}
+
+bool write_manifest(const std::string& path, const Manifest& manifest)
+{
+    std::string data;
+    NCodec::Codec<uint32_t>::write(data, manifest_magic);
+    NCodec::Codec<uint32_t>::write(data, manifest_version);
+    NCodec::Codec<uint64_t>::write(data, manifest.generation);
+    NCodec::Codec<std::string>::write(data, manifest.values);
+    NCodec::Codec<uint32_t>::write(data, manifest.partitions.size());
+    for (const auto& partition: manifest.partitions) {
+        NCodec::Codec<std::string>::write(data, partition.file);
+        NCodec::Codec<uint64_t>::write(data, partition.records);
+        NCodec::Codec<uint64_t>::write(data, partition.bytes);
+    }
+
+    const int fd = open(
+        path.c_str(),
+        O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+        0644);
+    if (fd == -1) {
+        return false;
+    }
+
+    bool ok = NCodec::write_all(fd, data);
+    ok &= fsync(fd) == 0;
+    close(fd);
+
+    if (!ok) {
+        unlink(path.c_str());
+    }
+    return ok;
+}
+
+bool commit_manifest(const std::string& prefix, const Manifest& manifest)
+{
+    const auto path = manifest_path(prefix);
+    const auto tmp_path = path + ".tmp";
+    if (!write_manifest(tmp_path, manifest)) {
+        return false;
+    }
+
+    if (rename(tmp_path.c_str(), path.c_str()) != 0) {
+        unlink(tmp_path.c_str());
+        return false;
+    }
+
+    sync_directory(path);
+    return true;
+}
+
+void remove_replaced(const Manifest& old, const Manifest& current)
+{
+    std::set<std::string> used;
+    for (const auto& partition: current.partitions) {
+        used.insert(partition.file);
+    }
+
+    for (const auto& partition: old.partitions) {
+        if (!partition.file.empty() && !used.count(partition.file)) {
+            unlink(partition.file.c_str());
+        }
+    }
+
+    if (!old.values.empty() && old.values != current.values) {
+        unlink(old.values.c_str());
+    }
+}
+
+void sync_directory(const std::string& path)
+{
+    const auto slash = path.rfind('/');
+    const auto dir = slash == std::string::npos
+        ? std::string(".")
+        : path.substr(0, slash + 1);
+
+    const int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd != -1) {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+}   // namespace NCheckpoint
@@ -0,0 +1,190 @@
+#pragma once
+
+#include "codec.h"
+
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace NCheckpoint {
+
+////////////////////////////////////////////////////////////////////////////////
+
+/*
+ * checkpoint of an index: partition files written in parallel
+ * ("<prefix>db.<generation>.<k>.bin", NCodec records each) and the manifest
+ * naming them and the values file they point into ("<prefix>db.manifest");
+ * a checkpoint takes effect when its manifest is renamed into place, a
+ * crash before that leaves the previous one as it was
+ */
+
+// partition writes go out in steps of this many bytes
+constexpr size_t write_step = 64 * 1024;
+
+struct Partition
+{
+    std::string file;
+    uint64_t records = 0;
+    uint64_t bytes = 0;
+};
+
+struct Manifest
+{
+    uint64_t generation = 0;
+    std::vector<Partition> partitions;
+    // "<prefix>values.bin" unless a compaction replaced it
+    std::string values;
+};
+
+std::string manifest_path(const std::string& prefix);
+std::string partition_path(
+    const std::string& prefix,
+    uint64_t generation,
+    size_t k);
+// values file of a compaction into generation
+std::string values_path(const std::string& prefix, uint64_t generation);
+
+// the manifest, the single "<prefix>db.bin" of older versions as one
+// partition, or an empty checkpoint; values is always set
+Manifest read_manifest(const std::string& prefix);
+
+// journal of a kvtool key size conversion: while it exists the conversion
+// is committed but not every converted manifest is in place yet, the data
+// directory must not be used until kvtool finishes it
+constexpr auto convert_journal = "convert.pending";
+
+// writes the manifest to path and fsyncs it, the caller renames it
+bool write_manifest(const std::string& path, const Manifest& manifest);
+
+// writes the manifest to a temp file, fsyncs it, renames it into place and
+// fsyncs the directory
+bool commit_manifest(const std::string& prefix, const Manifest& manifest);
+
+// unlinks the files (partitions and values) of old that current does not
+// use
+void remove_replaced(const Manifest& old, const Manifest& current);
+
+// makes renames in the directory of path durable
+void sync_directory(const std::string& path);
+
+////////////////////////////////////////////////////////////////////////////////
+
+// writes map (an unordered container) into partitions files, each from its
+// own range of buckets on its own thread, and fsyncs them; throttle(bytes)
+// runs before every write; nullopt on an error, nothing is left behind then
+template<NCodec::Codable K, NCodec::Codable V, class TMap>
+std::optional<Manifest> write_partitions(
+    const std::string& prefix,
+    uint64_t generation,
+    const TMap& map,
+    size_t partitions,
+    const std::function<void(size_t)>& throttle)
+{
+    Manifest manifest;
+    manifest.generation = generation;
+    manifest.partitions.resize(partitions);
+
+    // not a vector<bool>, the threads write their own elements
+    std::vector<char> ok(partitions, 1);
+    const size_t buckets = map.bucket_count();
+
+    auto write = [&] (size_t k) {
+        auto& partition = manifest.partitions[k];
+        partition.file = partition_path(prefix, generation, k);
+
+        const int fd = open(
+            partition.file.c_str(),
+            O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+            0644);
+        if (fd == -1) {
+            ok[k] = 0;
+            return;
+        }
+
+        std::string buffer;
+        buffer.reserve(write_step + 1024);
+        auto flush = [&] () {
+            if (throttle) {
+                throttle(buffer.size());
+            }
+            ok[k] &= NCodec::write_all(fd, buffer);
+            partition.bytes += buffer.size();
+            buffer.clear();
+        };
+
+        const auto first = buckets * k / partitions;
+        const auto last = buckets * (k + 1) / partitions;
+        for (size_t b = first; b < last; ++b) {
+            for (auto it = map.begin(b); it != map.end(b); ++it) {
+                NCodec::append_record(buffer, it->first, it->second);
+                ++partition.records;
+                if (buffer.size() >= write_step) {
+                    flush();
+                }
+            }
+        }
+        flush();
+
+        ok[k] &= fsync(fd) == 0;
+        close(fd);
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t k = 1; k < partitions; ++k) {
+        threads.emplace_back(write, k);
+    }
+    write(0);
+    for (auto& thread: threads) {
+        thread.join();
+    }
+
+    for (auto k_ok: ok) {
+        if (!k_ok) {
+            remove_replaced(manifest, Manifest());
+            return std::nullopt;
+        }
+    }
+
+    return manifest;
+}
+
+// the records of every partition, parsed in parallel, a torn tail of a
+// partition is skipped
+template<NCodec::Codable K, NCodec::Codable V>
+std::vector<std::vector<std::pair<K, V>>> read_partitions(
+    const Manifest& manifest)
+{
+    const auto& partitions = manifest.partitions;
+    std::vector<std::vector<std::pair<K, V>>> records(partitions.size());
+
+    auto read = [&] (size_t k) {
+        records[k].reserve(partitions[k].records);
+        NCodec::read_records<K, V>(
+            NCodec::read_file(partitions[k].file),
+            [&] (const K& key, const V& value) {
+                records[k].emplace_back(key, value);
+            });
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t k = 1; k < partitions.size(); ++k) {
+        threads.emplace_back(read, k);
+    }
+    if (!partitions.empty()) {
+        read(0);
+    }
+    for (auto& thread: threads) {
+        thread.join();
+    }
+
+    return records;
+}
+
+}   // namespace NCheckpoint
@@ -3,13 +3,23 @@
 #include "protocol.h"
 #include "rpc.h"
 
+#include <algorithm>
 #include <array>
+#include <chrono>
+#include <cmath>
 #include <cstdlib>
 #include <cstring>
-#include <sstream>
+#include <deque>
+#include <map>
+#include <optional>
+#include <random>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
 
 #include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
 
 #include <arpa/inet.h>
@@ -20,6 +30,7 @@
 static_assert(EAGAIN == EWOULDBLOCK);
 
 using namespace NLogging;
+using namespace NPool;
 using namespace NProtocol;
 using namespace NRpc;
 
@@ -30,32 +41,161 @@ namespace {
 constexpr int max_events = 32;
 constexpr int timeout = 1000;
 
-}   // namespace
+// the ingest stage streams its file in chunks of this size
+constexpr size_t ingest_chunk_size = 1024 * 1024;
 
-////////////////////////////////////////////////////////////////////////////////
+struct ClientEnv
+{
+    // number of parallel connections, each served by its own thread
+    int threads = 1;
 
-int main(int argc, const char** argv) {
-    /*
-     * simplistic arg parsing
-     * TODO proper argparse lib
-     */
+    // zipf skew of the keys read by the get stage, 0 reads every key once
+    double zipf = 0;
 
-    if (argc < 3) {
-        return 1;
+    // size of every value written by the put stage
+    int value_size = 64;
+
+    // 1: protobuf messages, 2: raw binary v2 messages
+    int protocol = 1;
+
+    // max requests in flight per connection, 0 sends everything at once
+    int depth = 0;
+
+    // PRIORITY_* hint of the v1 requests
+    uint32_t priority = PRIORITY_NORMAL;
+
+    // namespace of the v1 requests, "" is the default one
+    std::string ns;
+
+    // 16: keys are 16-byte binary ids for KEY_SIZE=16 servers, sent with
+    // the *_K16 messages over v2
+    size_t key_size = 0;
+
+    // file the backup stage writes the streamed backup of NAMESPACE to,
+    // with BACKUP_REMOTE the server writes it instead
+    std::string backup_path = "backup.bin";
+    bool backup_remote = false;
+    // bytes per second, 0 leaves it to the server's background io budget
+    uint64_t backup_rate = 0;
+
+    // dataset (the backup format) the ingest stage sends in chunks to
+    // NAMESPACE, with INGEST_REMOTE the server reads the file instead
+    std::string ingest_path = "ingest.bin";
+    bool ingest_remote = false;
+
+    ClientEnv()
+    {
+        if (auto value = std::getenv("THREADS")) {
+            threads = atoi(value);
+            VERIFY(threads > 0, "invalid THREADS");
+        }
+
+        if (auto value = std::getenv("VALUE_SIZE")) {
+            value_size = atoi(value);
+            VERIFY(value_size >= 0, "invalid VALUE_SIZE");
+        }
+
+        if (auto value = std::getenv("PROTOCOL")) {
+            protocol = atoi(value);
+            VERIFY(protocol == 1 || protocol == 2, "invalid PROTOCOL");
+        }
+
+        if (auto value = std::getenv("DEPTH")) {
+            depth = atoi(value);
+            VERIFY(depth >= 0, "invalid DEPTH");
+        }
+
+        if (auto value = std::getenv("KEY_SIZE")) {
+            key_size = strtoull(value, nullptr, 10);
+            VERIFY(key_size == 0 || key_size == fixed_key_size,
+                "invalid KEY_SIZE");
+        }
+
+        if (auto value = std::getenv("NAMESPACE")) {
+            ns = value;
+            VERIFY(protocol == 1, "NAMESPACE needs PROTOCOL=1");
+        }
+
+        if (auto value = std::getenv("PRIORITY")) {
+            priority = atoi(value);
+            VERIFY(priority <= PRIORITY_LOW, "invalid PRIORITY");
+        }
+
+        if (auto value = std::getenv("BACKUP_PATH")) {
+            backup_path = value;
+        }
+
+        if (auto value = std::getenv("BACKUP_REMOTE")) {
+            backup_remote = atoi(value);
+        }
+
+        if (auto value = std::getenv("BACKUP_RATE")) {
+            backup_rate = strtoull(value, nullptr, 10);
+        }
+
+        if (auto value = std::getenv("INGEST_PATH")) {
+            ingest_path = value;
+        }
+
+        if (auto value = std::getenv("INGEST_REMOTE")) {
+            ingest_remote = atoi(value);
+        }
+
+        if (auto value = std::getenv("ZIPF")) {
+            zipf = atof(value);
+            VERIFY(zipf >= 0, "invalid ZIPF");
+        }
     }
+};
 
-    const auto port = atoi(argv[1]);
-    const auto max_requests = atoi(argv[2]);
-    std::vector<std::string> stages;
+////////////////////////////////////////////////////////////////////////////////
 
-    for (int i = 3; i < argc; ++i) {
-        stages.push_back(argv[i]);
+// ranks in [0, n), rank k is drawn with probability ~ 1 / (k + 1)^theta
+class ZipfGenerator
+{
+private:
+    std::vector<double> Cdf;
+    std::mt19937_64 Rng;
+    std::uniform_real_distribution<double> Uniform{0, 1};
+
+public:
+    ZipfGenerator(int n, double theta, uint64_t seed)
+        : Cdf(n)
+        , Rng(seed)
+    {
+        double sum = 0;
+        for (int k = 0; k < n; ++k) {
+            sum += 1 / std::pow(k + 1, theta);
+            Cdf[k] = sum;
+        }
+
+        for (auto& p: Cdf) {
+            p /= sum;
+        }
     }
 
-    if (stages.empty()) {
-        stages = {"put", "get"};
+    int next()
+    {
+        auto it = std::lower_bound(Cdf.begin(), Cdf.end(), Uniform(Rng));
+        return std::min<int>(it - Cdf.begin(), Cdf.size() - 1);
     }
+};
+
+////////////////////////////////////////////////////////////////////////////////
 
+using Clock = std::chrono::steady_clock;
+
+// runs all stages over a single connection using keys
+// [first_key, first_key + max_requests), latencies gets the time from send
+// to response of every request in microseconds
+int run_connection(
+    const ClientEnv& env,
+    int port,
+    int max_requests,
+    int first_key,
+    const std::vector<std::string>& stages,
+    std::vector<uint32_t>& latencies)
+{
     /*
      * socket initialization
      */
@@ -103,9 +243,20 @@ int main(int argc, const char** argv) {
      * generating requests
      */
 
-    auto generate_data = [] (int i) {
+    auto make_key = [&] (int i) {
+        if (!env.key_size) {
+            return "key" + std::to_string(i);
+        }
+
+        std::string key(fixed_key_size, 0);
+        const uint64_t id = i;
+        memcpy(&key[fixed_key_size - sizeof(id)], &id, sizeof(id));
+        return key;
+    };
+
+    auto generate_data = [&] (int i) {
         std::string result = "";
-        for (int j = 0; j < 64; j++) {
+        for (int j = 0; j < env.value_size; j++) {
             result.push_back((char) (((i + j) % 27) + 'a'));
         }
         return result;
@@ -113,47 +264,127 @@ int main(int argc, const char** argv) {
 
     uint64_t request_count = 0;
 
+    // generated requests in request_id order, sent DEPTH at a time
+    std::deque<BufferRef> requests;
+
     auto stage_put = [&] () {
-        for (int i = 0; i < max_requests; ++i) {
-            std::stringstream key;
-            key << "key" << i;
+        for (int i = first_key; i < first_key + max_requests; ++i) {
+            const auto key = make_key(i);
+
+            if (env.protocol == 2) {
+                const auto data = generate_data(i);
+                requests.push_back(serialize_message_v2(
+                    env.key_size ? PUT_REQUEST_K16 : PUT_REQUEST_V2,
+                    MessageV2{request_count++, key, data}));
+                continue;
+            }
 
             NProto::TPutRequest put_request;
             put_request.set_request_id(request_count++);
-            put_request.set_key(key.str());
+            put_request.set_key(key);
+            put_request.set_priority(env.priority);
+            put_request.set_ns(env.ns);
             put_request.set_offset(generate_data(i));
 
-            std::stringstream message;
-            serialize_header(PUT_REQUEST, put_request.ByteSizeLong(), message);
-            put_request.SerializeToOstream(&message);
-
-            state.output_queue.push_back(message.str());
+            requests.push_back(
+                serialize_message(PUT_REQUEST, put_request));
         }
     };
 
-    std::unordered_map<uint64_t, std::string> expected_gets;
+    // request_id -> key index, values are regenerated when checked
+    std::unordered_map<uint64_t, int> expected_gets;
+
+    std::optional<ZipfGenerator> zipf;
+    if (env.zipf > 0) {
+        zipf.emplace(max_requests, env.zipf, first_key + 1);
+    }
 
     auto stage_get = [&] () {
-        for (int i = 0; i < max_requests; ++i) {
-            std::stringstream key;
-            key << "key" << i;
+        for (int j = first_key; j < first_key + max_requests; ++j) {
+            const int i = zipf ? first_key + zipf->next() : j;
+
+            const auto key = make_key(i);
+
+            if (env.protocol == 2) {
+                expected_gets[request_count] = i;
+                requests.push_back(serialize_message_v2(
+                    env.key_size ? GET_REQUEST_K16 : GET_REQUEST_V2,
+                    MessageV2{request_count++, key, {}}));
+                continue;
+            }
 
             NProto::TGetRequest get_request;
             get_request.set_request_id(request_count++);
-            get_request.set_key(key.str());
-            expected_gets[get_request.request_id()] = generate_data(i);
+            get_request.set_key(key);
+            get_request.set_priority(env.priority);
+            get_request.set_ns(env.ns);
+            expected_gets[get_request.request_id()] = i;
+
+            requests.push_back(
+                serialize_message(GET_REQUEST, get_request));
+        }
+    };
+
+    auto stage_stats = [&] () {
+        NProto::TStatsRequest stats_request;
+        stats_request.set_request_id(request_count++);
 
-            std::stringstream message;
-            serialize_header(GET_REQUEST, get_request.ByteSizeLong(), message);
-            get_request.SerializeToOstream(&message);
+        requests.push_back(serialize_message(STATS_REQUEST, stats_request));
+    };
 
-            state.output_queue.push_back(message.str());
+    auto stage_backup = [&] () {
+        NProto::TBackupRequest backup_request;
+        backup_request.set_request_id(request_count++);
+        backup_request.set_ns(env.ns);
+        backup_request.set_rate(env.backup_rate);
+        if (env.backup_remote) {
+            backup_request.set_path(env.backup_path);
         }
+
+        requests.push_back(serialize_message(BACKUP_REQUEST, backup_request));
+    };
+
+    auto stage_ingest = [&] () {
+        NProto::TIngestRequest ingest_request;
+        ingest_request.set_ns(env.ns);
+
+        if (env.ingest_remote) {
+            ingest_request.set_request_id(request_count++);
+            ingest_request.set_path(env.ingest_path);
+            requests.push_back(
+                serialize_message(INGEST_REQUEST, ingest_request));
+            return;
+        }
+
+        const int fd = open(env.ingest_path.c_str(), O_RDONLY | O_CLOEXEC);
+        VERIFY(fd != -1, "failed to open the ingest file");
+
+        ingest_request.set_stream(request_count);
+        std::string chunk(ingest_chunk_size, 0);
+        while (true) {
+            const auto n = read(fd, chunk.data(), chunk.size());
+            VERIFY(n >= 0, "failed to read the ingest file");
+
+            ingest_request.set_request_id(request_count++);
+            ingest_request.set_data(chunk.data(), n);
+            ingest_request.set_last(n == 0);
+            requests.push_back(
+                serialize_message(INGEST_REQUEST, ingest_request));
+
+            if (n == 0) {
+                break;
+            }
+        }
+
+        close(fd);
     };
 
     std::unordered_map<std::string, std::function<void()>> stage2func = {
         {"put", stage_put},
         {"get", stage_get},
+        {"stats", stage_stats},
+        {"backup", stage_backup},
+        {"ingest", stage_ingest},
     };
 
     for (const auto& stage: stages) {
@@ -164,9 +395,46 @@ int main(int argc, const char** argv) {
      * handler function
      */
 
-    int response_count = 0;
+    uint64_t response_count = 0;
+
+    uint64_t sent_count = 0;
+    std::vector<Clock::time_point> sent_at(request_count);
+    latencies.reserve(latencies.size() + request_count);
+
+    auto send_more = [&] () {
+        while (!requests.empty()
+                && (!env.depth || sent_count - response_count < uint64_t(env.depth)))
+        {
+            sent_at[sent_count++] = Clock::now();
+            state.output_queue.push_back(std::move(requests.front()));
+            requests.pop_front();
+        }
+    };
+
+    auto on_response = [&] (uint64_t request_id) {
+        if (request_id < sent_at.size()) {
+            latencies.push_back(
+                std::chrono::duration_cast<std::chrono::microseconds>(
+                    Clock::now() - sent_at[request_id]).count());
+        }
+
+        ++response_count;
+    };
 
-    auto handle_get = [&] (const std::string& response) {
+    auto check_get = [&] (uint64_t request_id, std::string_view value) {
+        auto it = expected_gets.find(request_id);
+        if (it == expected_gets.end()) {
+            LOG_ERROR_S("unexpected get request_id " << request_id);
+        } else if (generate_data(it->second) != value) {
+            LOG_ERROR_S("unexpected data for get request_id " << request_id
+                << ", actual " << value
+                << ", expected " << generate_data(it->second));
+        }
+
+        on_response(request_id);
+    };
+
+    auto handle_get = [&] (const BufferRef& response) {
         NProto::TGetResponse get_response;
         if (!get_response.ParseFromArray(response.data(), response.size())) {
             // TODO proper handling
@@ -176,23 +444,32 @@ int main(int argc, const char** argv) {
 
         LOG_DEBUG_S("get_response: " << get_response.ShortDebugString());
 
-        auto it = expected_gets.find(get_response.request_id());
-        if (it == expected_gets.end()) {
-            LOG_ERROR_S("unexpected get request_id "
-                << get_response.request_id());
-        } else if (it->second != get_response.offset()) {
-            LOG_ERROR_S("unexpected data for get request_id "
-                << get_response.request_id()
-                << ", actual " << get_response.offset()
-                << ", expected " << it->second);
+        check_get(get_response.request_id(), get_response.offset());
+
+        return BufferRef();
+    };
+
+    auto handle_v2 = [&] (char message_type, const BufferRef& response) {
+        MessageV2 message;
+        if (!parse_message_v2(message_type, response.view(), message)) {
+            // TODO proper handling
+
+            abort();
         }
 
-        ++response_count;
+        LOG_DEBUG_S("v2 response: type=" << int(message_type)
+            << " request_id=" << message.request_id);
+
+        if (message_type == GET_RESPONSE_V2) {
+            check_get(message.request_id, message.value);
+        } else {
+            on_response(message.request_id);
+        }
 
-        return std::string();
+        return BufferRef();
     };
 
-    auto handle_put = [&] (const std::string& response) {
+    auto handle_put = [&] (const BufferRef& response) {
         NProto::TPutResponse put_response;
         if (!put_response.ParseFromArray(response.data(), response.size())) {
             // TODO proper handling
@@ -202,21 +479,127 @@ int main(int argc, const char** argv) {
 
         LOG_DEBUG_S("put_response: " << put_response.ShortDebugString());
 
-        ++response_count;
+        on_response(put_response.request_id());
+
+        return BufferRef();
+    };
+
+    auto handle_stats = [&] (const BufferRef& response) {
+        NProto::TStatsResponse stats_response;
+        if (!stats_response.ParseFromArray(response.data(), response.size())) {
+            // TODO proper handling
+
+            abort();
+        }
+
+        std::map<std::string, int64_t> counters(
+            stats_response.counters().begin(),
+            stats_response.counters().end());
+        for (const auto& [name, value]: counters) {
+            LOG_INFO_S("server " << name << " = " << value);
+        }
+
+        on_response(stats_response.request_id());
 
-        return std::string();
+        return BufferRef();
     };
 
-    Handler handler = [&] (char message_type, const std::string& response) {
+    // streamed backup, written to BACKUP_PATH once it is complete
+    std::string backup_tmp_path = env.backup_path + ".tmp";
+    int backup_fd = -1;
+
+    auto handle_backup = [&] (const BufferRef& response) {
+        NProto::TBackupResponse backup_response;
+        if (!backup_response.ParseFromArray(response.data(), response.size())) {
+            // TODO proper handling
+
+            abort();
+        }
+
+        if (!backup_response.data().empty()) {
+            if (backup_fd == -1) {
+                backup_fd = open(
+                    backup_tmp_path.c_str(),
+                    O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                    0644);
+                VERIFY(backup_fd != -1, "failed to open the backup file");
+            }
+
+            const auto& data = backup_response.data();
+            size_t written = 0;
+            while (written < data.size()) {
+                const auto n = write(
+                    backup_fd,
+                    data.data() + written,
+                    data.size() - written);
+                VERIFY(n > 0, "failed to write the backup file");
+                written += n;
+            }
+        }
+
+        if (!backup_response.last()) {
+            return BufferRef();
+        }
+
+        if (backup_fd != -1) {
+            fsync(backup_fd);
+            close(backup_fd);
+            backup_fd = -1;
+            if (backup_response.error().empty()) {
+                rename(backup_tmp_path.c_str(), env.backup_path.c_str());
+            } else {
+                unlink(backup_tmp_path.c_str());
+            }
+        }
+
+        if (!backup_response.error().empty()) {
+            LOG_ERROR_S("backup failed: " << backup_response.error());
+        } else {
+            LOG_INFO_S("backup " << env.backup_path << ": "
+                << backup_response.records() << " records, "
+                << backup_response.bytes() << " bytes");
+        }
+
+        on_response(backup_response.request_id());
+
+        return BufferRef();
+    };
+
+    auto handle_ingest = [&] (const BufferRef& response) {
+        NProto::TIngestResponse ingest_response;
+        if (!ingest_response.ParseFromArray(response.data(), response.size())) {
+            // TODO proper handling
+
+            abort();
+        }
+
+        if (!ingest_response.error().empty()) {
+            LOG_ERROR_S("ingest failed: " << ingest_response.error());
+        } else if (ingest_response.records()) {
+            LOG_INFO_S("ingested " << ingest_response.records()
+                << " records");
+        }
+
+        on_response(ingest_response.request_id());
+
+        return BufferRef();
+    };
+
+    Handler handler = [&] (char message_type, const BufferRef& response) {
         switch (message_type) {
             case PUT_RESPONSE: return handle_put(response);
             case GET_RESPONSE: return handle_get(response);
+            case PUT_RESPONSE_V2:
+            case GET_RESPONSE_V2: return handle_v2(message_type, response);
+            case STATS_RESPONSE: return handle_stats(response);
+            case BACKUP_RESPONSE: return handle_backup(response);
+            case INGEST_RESPONSE: return handle_ingest(response);
         }
 
         // TODO proper handling
 
         abort();
-        return std::string();
+        return BufferRef();
     };
 
     /*
@@ -234,6 +617,7 @@ int main(int argc, const char** argv) {
         }
     }
 
+    send_more();
     if (!process_output(state)) {
         LOG_ERROR("failed to send request");
         return 3;
@@ -249,6 +633,15 @@ int main(int argc, const char** argv) {
                     LOG_ERROR("failed to read response");
                     return 2;
                 }
+
+                // the socket is writable already, EPOLLOUT won't fire
+                if (env.depth && !requests.empty()) {
+                    send_more();
+                    if (!process_output(state)) {
+                        LOG_ERROR("failed to send request");
+                        return 3;
+                    }
+                }
             }
 
             if ((events[i].events & EPOLLOUT)) {
@@ -264,3 +657,170 @@ int main(int argc, const char** argv) {
 
     return 0;
 }
+
+// opens max_requests short-lived connections one after another, each sends
+// a single get and waits for its response, measures the accept path
+int run_connects(int port, int max_requests)
+{
+    struct sockaddr_in dest;
+    bzero(&dest, sizeof(dest));
+    dest.sin_family = AF_INET;
+    dest.sin_port = htons(port);
+    inet_pton(AF_INET, "127.0.0.1", &dest.sin_addr.s_addr);
+
+    NProto::TGetRequest get_request;
+    get_request.set_request_id(0);
+    get_request.set_key("key0");
+    const auto request = serialize_message(GET_REQUEST, get_request);
+
+    for (int i = 0; i < max_requests; ++i) {
+        int socketfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (socketfd == -1) {
+            perror("failed to create socket");
+            return errno;
+        }
+
+        if (connect(socketfd, (struct sockaddr*)&dest, sizeof(dest)) != 0) {
+            perror("failed to connect");
+            close(socketfd);
+            return errno;
+        }
+
+        if (write(socketfd, request.data(), request.size())
+                != static_cast<ssize_t>(request.size()))
+        {
+            LOG_ERROR("failed to send request");
+            close(socketfd);
+            return 3;
+        }
+
+        // header first, then the rest of the message
+        char header[header_size];
+        size_t expected = header_size;
+        size_t received = 0;
+        bool header_done = false;
+        while (received < expected) {
+            char buf[512];
+            const auto count = read(
+                socketfd,
+                buf,
+                std::min(sizeof(buf), expected - received));
+            if (count <= 0) {
+                LOG_ERROR("failed to read response");
+                close(socketfd);
+                return 2;
+            }
+
+            if (!header_done) {
+                memcpy(header + received, buf, count);
+            }
+
+            received += count;
+            if (!header_done && received == header_size) {
+                uint32_t len;
+                memcpy(&len, header + 1, sizeof(len));
+                expected += len;
+                header_done = true;
+            }
+        }
+
+        close(socketfd);
+    }
+
+    return 0;
+}
+
+}   // namespace
+
+////////////////////////////////////////////////////////////////////////////////
+
+int main(int argc, const char** argv) {
+    /*
+     * simplistic arg parsing
+     * TODO proper argparse lib
+     */
+
+    if (argc < 3) {
+        return 1;
+    }
+
+    const ClientEnv env;
+    const auto port = atoi(argv[1]);
+    const auto max_requests = atoi(argv[2]);
+    std::vector<std::string> stages;
+
+    for (int i = 3; i < argc; ++i) {
+        stages.push_back(argv[i]);
+    }
+
+    if (stages.empty()) {
+        stages = {"put", "get"};
+    }
+
+    // connect is a stage of its own, every request gets a new connection
+    const bool connect_stage = stages == std::vector<std::string>{"connect"};
+
+    /*
+     * every connection gets a disjoint key range so that the get stage can
+     * verify the values written by its own put stage
+     */
+
+    const auto start = std::chrono::steady_clock::now();
+
+    std::vector<std::thread> connections;
+    std::vector<int> results(env.threads, 0);
+    std::vector<std::vector<uint32_t>> latencies(env.threads);
+    for (int i = 0; i < env.threads; ++i) {
+        connections.emplace_back([&, i] () {
+            results[i] = connect_stage
+                ? ::run_connects(port, max_requests)
+                : ::run_connection(
+                    env,
+                    port,
+                    max_requests,
+                    i * max_requests,
+                    stages,
+                    latencies[i]);
+        });
+    }
+
+    int result = 0;
+    for (int i = 0; i < env.threads; ++i) {
+        connections[i].join();
+        result = std::max(result, results[i]);
+    }
+
+    const auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start).count();
+    const auto total = static_cast<uint64_t>(env.threads)
+        * max_requests * stages.size();
+
+    if (connect_stage) {
+        LOG_INFO_S(total << " connections over " << env.threads
+            << " threads in " << elapsed / 1000 << " ms ("
+            << total * 1000000 / std::max<int64_t>(elapsed, 1)
+            << " connections/s)");
+    } else {
+        LOG_INFO_S(total << " requests over " << env.threads
+            << " connections in " << elapsed / 1000 << " ms ("
+            << total * 1000000 / std::max<int64_t>(elapsed, 1) << " rps)");
+
+        std::vector<uint32_t> all;
+        for (const auto& l: latencies) {
+            all.insert(all.end(), l.begin(), l.end());
+        }
+        std::sort(all.begin(), all.end());
+
+        auto percentile = [&] (double p) {
+            return all.empty() ? 0 : all[std::min<size_t>(
+                all.size() * p, all.size() - 1)];
+        };
+
+        LOG_INFO_S("latency us: p50 " << percentile(0.5)
+            << ", p99 " << percentile(0.99)
+            << ", p99.9 " << percentile(0.999)
+            << ", max " << (all.empty() ? 0 : all.back()));
+    }
+
+    return result;
+}
@@ -0,0 +1,84 @@
+#include "codec.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace NCodec {
+
+////////////////////////////////////////////////////////////////////////////////
+
+std::string read_file(const std::string& path)
+{
+    std::string data;
+
+    const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return data;
+    }
+
+    char buf[64 * 1024];
+    while (true) {
+        const auto n = read(fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        data.append(buf, n);
+    }
+
+    close(fd);
+    return data;
+}
+
+bool write_all(int fd, std::string_view data)
+{
+    while (!data.empty()) {
+        const auto n = write(fd, data.data(), data.size());
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        data.remove_prefix(n);
+    }
+
+    return true;
+}
+
+bool pwritev_all(int fd, struct iovec* iov, size_t count, uint64_t offset)
+{
+    while (count) {
+        const int batch = std::min<size_t>(count, IOV_MAX);
+        auto n = pwritev(fd, iov, batch, offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        offset += n;
+
+        // skips the written buffers, a short write resumes mid-buffer
+        while (count && size_t(n) >= iov->iov_len) {
+            n -= iov->iov_len;
+            ++iov;
+            --count;
+        }
+        if (n) {
+            iov->iov_base = static_cast<char*>(iov->iov_base) + n;
+            iov->iov_len -= n;
+        }
+    }
+
+    return true;
+}
+
+}   // namespace NCodec
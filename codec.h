@@ -0,0 +1,163 @@
+#pragma once
+
+#include <concepts>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+#include <sys/uio.h>
+
+namespace NCodec {
+
+////////////////////////////////////////////////////////////////////////////////
+
+// binary encoding of table keys and values, picked at compile time:
+// write appends the encoded value, read consumes it from the front of in
+// and fails on a truncated input
+template <typename T>
+struct Codec;
+
+// fixed-width pod, copied as is (host byte order)
+template <typename T>
+    requires std::is_trivially_copyable_v<T>
+struct Codec<T>
+{
+    static constexpr bool fixed_size = true;
+
+    static void write(std::string& out, const T& value)
+    {
+        out.append(reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+
+    static bool read(std::string_view& in, T& value)
+    {
+        if (in.size() < sizeof(T)) {
+            return false;
+        }
+
+        memcpy(&value, in.data(), sizeof(T));
+        in.remove_prefix(sizeof(T));
+        return true;
+    }
+};
+
+// len (4 bytes) bytes
+template <>
+struct Codec<std::string>
+{
+    static constexpr bool fixed_size = false;
+
+    static void write(std::string& out, const std::string& value)
+    {
+        Codec<uint32_t>::write(out, value.size());
+        out.append(value);
+    }
+
+    static bool read(std::string_view& in, std::string& value)
+    {
+        uint32_t len = 0;
+        auto rest = in;
+        if (!Codec<uint32_t>::read(rest, len) || rest.size() < len) {
+            return false;
+        }
+
+        value.assign(rest.data(), len);
+        in = rest.substr(len);
+        return true;
+    }
+};
+
+template <typename T>
+concept Codable = requires(
+    std::string& out,
+    std::string_view& in,
+    const T& value,
+    T& result)
+{
+    { Codec<T>::fixed_size } -> std::convertible_to<bool>;
+    Codec<T>::write(out, value);
+    { Codec<T>::read(in, result) } -> std::same_as<bool>;
+};
+
+// fixed-size binary key (e.g. a uuid) stored inline in the index, its bytes
+// as two words
+struct Key16
+{
+    uint64_t hi = 0;
+    uint64_t lo = 0;
+
+    bool operator==(const Key16& other) const = default;
+};
+
+static_assert(sizeof(Key16) == 16);
+
+// the request key bytes of an index key
+inline std::string_view key_bytes(const std::string& key)
+{
+    return key;
+}
+
+inline std::string_view key_bytes(const Key16& key)
+{
+    return {reinterpret_cast<const char*>(&key), sizeof(key)};
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// key value key value ..., no header: a torn record at the end of a file is
+// dropped by read_records
+template <Codable K, Codable V>
+void append_record(std::string& out, const K& key, const V& value)
+{
+    Codec<K>::write(out, key);
+    Codec<V>::write(out, value);
+}
+
+// calls func(key, value) for every complete record, returns the number of
+// bytes consumed
+template <Codable K, Codable V, typename TFunc>
+size_t read_records(std::string_view in, TFunc&& func)
+{
+    const auto size = in.size();
+    size_t consumed = 0;
+
+    K key{};
+    V value{};
+    while (!in.empty()) {
+        if (!Codec<K>::read(in, key) || !Codec<V>::read(in, value)) {
+            break;
+        }
+
+        func(key, value);
+        consumed = size - in.size();
+    }
+
+    return consumed;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// whole file contents, empty if it does not exist
+std::string read_file(const std::string& path);
+
+// writes all of data at the fd's position, false on error
+bool write_all(int fd, std::string_view data);
+
+// writes all of the buffers at offset with as few pwritev calls as
+// IOV_MAX allows, consumes iov; false on error
+bool pwritev_all(int fd, struct iovec* iov, size_t count, uint64_t offset);
+
+}   // namespace NCodec
+
+// the keys are ids, i.e. random already: mixing the words is enough
+template <>
+struct std::hash<NCodec::Key16>
+{
+    size_t operator()(const NCodec::Key16& key) const noexcept
+    {
+        return key.hi ^ (key.lo * 0x9e3779b97f4a7c15ULL);
+    }
+};
@@ -0,0 +1 @@
+#include "coro.h"
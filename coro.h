@@ -0,0 +1,339 @@
+#pragma once
+
+#include "executor.h"
+#include "reactor.h"
+
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace NCoro {
+
+////////////////////////////////////////////////////////////////////////////////
+
+namespace NPrivate {
+
+// resumes whoever awaited the finished task
+struct FinalAwaiter
+{
+    bool await_ready() noexcept
+    {
+        return false;
+    }
+
+    template <typename TPromise>
+    std::coroutine_handle<> await_suspend(
+        std::coroutine_handle<TPromise> handle) noexcept
+    {
+        if (auto continuation = handle.promise().continuation) {
+            return continuation;
+        }
+
+        return std::noop_coroutine();
+    }
+
+    void await_resume() noexcept
+    {
+    }
+};
+
+struct PromiseBase
+{
+    std::coroutine_handle<> continuation;
+
+    std::suspend_always initial_suspend() noexcept
+    {
+        return {};
+    }
+
+    FinalAwaiter final_suspend() noexcept
+    {
+        return {};
+    }
+
+    void unhandled_exception()
+    {
+        std::terminate();
+    }
+};
+
+}   // namespace NPrivate
+
+////////////////////////////////////////////////////////////////////////////////
+
+// lazy coroutine, starts when awaited and resumes the awaiter when done
+template <typename T = void>
+class Task
+{
+public:
+    struct promise_type: NPrivate::PromiseBase
+    {
+        std::optional<T> value;
+
+        Task get_return_object()
+        {
+            return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+
+        void return_value(T v)
+        {
+            value = std::move(v);
+        }
+    };
+
+private:
+    std::coroutine_handle<promise_type> Handle;
+
+public:
+    explicit Task(std::coroutine_handle<promise_type> handle)
+        : Handle(handle)
+    {
+    }
+
+    Task(Task&& other) noexcept
+        : Handle(std::exchange(other.Handle, nullptr))
+    {
+    }
+
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+
+    ~Task()
+    {
+        if (Handle) {
+            Handle.destroy();
+        }
+    }
+
+    bool await_ready() const noexcept
+    {
+        return false;
+    }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter)
+    {
+        Handle.promise().continuation = awaiter;
+        return Handle;
+    }
+
+    T await_resume()
+    {
+        return std::move(*Handle.promise().value);
+    }
+};
+
+template <>
+class Task<void>
+{
+public:
+    struct promise_type: NPrivate::PromiseBase
+    {
+        Task get_return_object()
+        {
+            return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+
+        void return_void()
+        {
+        }
+    };
+
+private:
+    std::coroutine_handle<promise_type> Handle;
+
+public:
+    explicit Task(std::coroutine_handle<promise_type> handle)
+        : Handle(handle)
+    {
+    }
+
+    Task(Task&& other) noexcept
+        : Handle(std::exchange(other.Handle, nullptr))
+    {
+    }
+
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+
+    ~Task()
+    {
+        if (Handle) {
+            Handle.destroy();
+        }
+    }
+
+    bool await_ready() const noexcept
+    {
+        return false;
+    }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter)
+    {
+        Handle.promise().continuation = awaiter;
+        return Handle;
+    }
+
+    void await_resume()
+    {
+    }
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+// coroutine frame that owns itself and is destroyed on completion
+struct Detached
+{
+    struct promise_type
+    {
+        Detached get_return_object()
+        {
+            return {};
+        }
+
+        std::suspend_never initial_suspend() noexcept
+        {
+            return {};
+        }
+
+        std::suspend_never final_suspend() noexcept
+        {
+            return {};
+        }
+
+        void return_void()
+        {
+        }
+
+        void unhandled_exception()
+        {
+            std::terminate();
+        }
+    };
+};
+
+// starts task right away, it runs until its first suspension point
+inline Detached spawn(Task<void> task)
+{
+    co_await task;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// runs a blocking func (file io) on the pool, then resumes the awaiting
+// coroutine on the reactor thread with its result
+template <typename TFunc>
+auto offload(
+    NExecutor::Executor& executor,
+    NReactor::Reactor& reactor,
+    NExecutor::EPriority priority,
+    TFunc func)
+{
+    using TResult = std::invoke_result_t<TFunc>;
+    static_assert(!std::is_void_v<TResult>, "offload needs a result");
+
+    struct Awaiter
+    {
+        NExecutor::Executor& executor;
+        NReactor::Reactor& reactor;
+        NExecutor::EPriority priority;
+        TFunc func;
+        std::optional<TResult> result;
+
+        bool await_ready() const noexcept
+        {
+            return false;
+        }
+
+        void await_suspend(std::coroutine_handle<> handle)
+        {
+            executor.submit([this, handle] () {
+                result.emplace(func());
+                reactor.schedule([handle] () {
+                    handle.resume();
+                });
+            }, priority);
+        }
+
+        TResult await_resume()
+        {
+            return std::move(*result);
+        }
+    };
+
+    return Awaiter{executor, reactor, priority, std::move(func), std::nullopt};
+}
+
+// coroutines waiting for the same thing to happen, whoever makes it happen
+// resumes them all; single-threaded, e.g. the reactor thread
+class WaitList
+{
+private:
+    std::vector<std::coroutine_handle<>> Waiters;
+
+public:
+    auto wait()
+    {
+        struct Awaiter
+        {
+            WaitList& list;
+
+            bool await_ready() const noexcept
+            {
+                return false;
+            }
+
+            void await_suspend(std::coroutine_handle<> handle)
+            {
+                list.Waiters.push_back(handle);
+            }
+
+            void await_resume()
+            {
+            }
+        };
+
+        return Awaiter{*this};
+    }
+
+    void notify_all()
+    {
+        auto waiters = std::move(Waiters);
+        Waiters.clear();
+        for (auto handle: waiters) {
+            handle.resume();
+        }
+    }
+};
+
+// resumes after the reactor's next flush, i.e. once the writes issued so
+// far are durable (the write-ahead log commit)
+inline auto flushed(NReactor::Reactor& reactor)
+{
+    struct Awaiter
+    {
+        NReactor::Reactor& reactor;
+
+        bool await_ready() const noexcept
+        {
+            return false;
+        }
+
+        void await_suspend(std::coroutine_handle<> handle)
+        {
+            reactor.flush_waiters.push_back([handle] () {
+                handle.resume();
+            });
+        }
+
+        void await_resume()
+        {
+        }
+    };
+
+    return Awaiter{reactor};
+}
+
+}   // namespace NCoro
@@ -0,0 +1,655 @@
+#include "codec.h"
+#include "kv.pb.h"
+#include "log.h"
+#include "protocol.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <optional>
+#include <random>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+using namespace NLogging;
+using namespace NProtocol;
+
+namespace {
+
+////////////////////////////////////////////////////////////////////////////////
+
+// stdout and stderr of every server run, appended
+constexpr auto server_log = "crashtest.server.log";
+
+// gets of the verification pass in flight at once
+constexpr int verify_batch = 1024;
+
+// the server is polled this often until it answers after a start
+constexpr int ready_poll_ms = 5;
+
+using Clock = std::chrono::steady_clock;
+
+struct TortureEnv
+{
+    // distinct keys the puts overwrite at random
+    int keys = 10000;
+
+    // size of every value, at least the version prefix is written
+    int value_size = 64;
+
+    // puts in flight, a kill loses at most this many unacknowledged ones;
+    // a key may be put several times at once, fewer keys repeat more often
+    int depth = 64;
+
+    // the server is killed this long after it answered, uniformly
+    int kill_min_ms = 50;
+    int kill_max_ms = 1000;
+
+    // after every kill the logs and values files get a torn record at the
+    // end, like a write cut short by the crash
+    bool torn = false;
+
+    // a start that does not answer within this long fails the run
+    int recovery_timeout_ms = 60000;
+
+    // namespace the puts go to, "" is the default one
+    std::string ns;
+
+    uint64_t seed = std::random_device()();
+
+    TortureEnv()
+    {
+        if (auto value = std::getenv("KEYS")) {
+            keys = atoi(value);
+            VERIFY(keys > 0, "invalid KEYS");
+        }
+
+        if (auto value = std::getenv("VALUE_SIZE")) {
+            value_size = atoi(value);
+            VERIFY(value_size >= 0, "invalid VALUE_SIZE");
+        }
+
+        if (auto value = std::getenv("DEPTH")) {
+            depth = atoi(value);
+            VERIFY(depth > 0, "invalid DEPTH");
+        }
+
+        if (auto value = std::getenv("KILL_MIN_MS")) {
+            kill_min_ms = atoi(value);
+        }
+
+        if (auto value = std::getenv("KILL_MAX_MS")) {
+            kill_max_ms = atoi(value);
+        }
+        VERIFY(kill_min_ms >= 0 && kill_min_ms <= kill_max_ms,
+            "invalid KILL_MIN_MS / KILL_MAX_MS");
+
+        if (auto value = std::getenv("TORN")) {
+            torn = atoi(value);
+        }
+
+        if (auto value = std::getenv("RECOVERY_TIMEOUT_MS")) {
+            recovery_timeout_ms = atoi(value);
+        }
+
+        if (auto value = std::getenv("NAMESPACE")) {
+            ns = value;
+        }
+
+        if (auto value = std::getenv("SEED")) {
+            seed = strtoull(value, nullptr, 10);
+        }
+    }
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+std::string make_key(int i)
+{
+    return "key" + std::to_string(i);
+}
+
+// "v<version>." padded to size, the version is checked after a restart
+std::string make_value(uint64_t version, int size)
+{
+    std::string value = "v";
+    value += std::to_string(version);
+    value += '.';
+    if (value.size() < size_t(size)) {
+        value.resize(size, char('a' + version % 26));
+    }
+    return value;
+}
+
+// 0 for a missing key, nullopt if the value is not one of make_value's
+std::optional<uint64_t> version_of(std::string_view value)
+{
+    if (value.empty()) {
+        return 0;
+    }
+
+    const auto dot = value.find('.');
+    if (value[0] != 'v' || dot == std::string_view::npos || dot == 1) {
+        return std::nullopt;
+    }
+
+    uint64_t version = 0;
+    for (auto c: value.substr(1, dot - 1)) {
+        if (c < '0' || c > '9') {
+            return std::nullopt;
+        }
+        version = version * 10 + (c - '0');
+    }
+    return version;
+}
+
+// what the server may hold for a key: a put is acknowledged only once it
+// is durable, the ones in flight at a kill may or may not have made it
+struct KeyState
+{
+    uint64_t acked = 0;
+    uint64_t sent = 0;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+pid_t start_server(const std::string& server, int port)
+{
+    const pid_t pid = fork();
+    VERIFY(pid != -1, "fork failed");
+    if (pid) {
+        return pid;
+    }
+
+    const int fd = open(server_log, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd != -1) {
+        dup2(fd, STDOUT_FILENO);
+        dup2(fd, STDERR_FILENO);
+        close(fd);
+    }
+
+    const auto port_arg = std::to_string(port);
+    execl(server.c_str(), server.c_str(), port_arg.c_str(), nullptr);
+    _exit(127);
+}
+
+int connect_to(int port)
+{
+    const int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        return -1;
+    }
+
+    struct sockaddr_in dest;
+    memset(&dest, 0, sizeof(dest));
+    dest.sin_family = AF_INET;
+    dest.sin_port = htons(port);
+    inet_pton(AF_INET, "127.0.0.1", &dest.sin_addr.s_addr);
+
+    if (connect(fd, (struct sockaddr*)&dest, sizeof(dest)) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+// blocking, false once the server is gone
+bool send_all(int fd, std::string_view data)
+{
+    while (!data.empty()) {
+        const auto n = send(fd, data.data(), data.size(), MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        data.remove_prefix(n);
+    }
+
+    return true;
+}
+
+bool read_exact(int fd, char* data, size_t size)
+{
+    while (size) {
+        const auto n = read(fd, data, size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        data += n;
+        size -= n;
+    }
+
+    return true;
+}
+
+// the next response frame, false once the server is gone
+bool read_response(int fd, char& message_type, std::string& payload)
+{
+    char header[header_size];
+    if (!read_exact(fd, header, header_size)) {
+        return false;
+    }
+
+    message_type = header[0];
+    uint32_t len = 0;
+    memcpy(&len, header + 1, sizeof(len));
+    payload.resize(len);
+    return read_exact(fd, payload.data(), len);
+}
+
+NPool::BufferRef get_request(
+    const TortureEnv& env,
+    uint64_t request_id,
+    int key)
+{
+    NProto::TGetRequest request;
+    request.set_request_id(request_id);
+    request.set_key(make_key(key));
+    request.set_ns(env.ns);
+    return serialize_message(GET_REQUEST, request);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// bytes of the data directory
+uint64_t data_size()
+{
+    uint64_t total = 0;
+
+    DIR* dir = opendir(".");
+    VERIFY(dir, "failed to open the data directory");
+    while (auto* entry = readdir(dir)) {
+        struct stat st;
+        if (strcmp(entry->d_name, server_log) != 0
+                && stat(entry->d_name, &st) == 0
+                && S_ISREG(st.st_mode))
+        {
+            total += st.st_size;
+        }
+    }
+    closedir(dir);
+
+    return total;
+}
+
+bool ends_with(std::string_view s, std::string_view suffix)
+{
+    return s.size() >= suffix.size()
+        && s.substr(s.size() - suffix.size()) == suffix;
+}
+
+// files a server would find in the directory
+bool has_data()
+{
+    bool found = false;
+
+    DIR* dir = opendir(".");
+    VERIFY(dir, "failed to open the data directory");
+    while (auto* entry = readdir(dir)) {
+        const std::string_view file = entry->d_name;
+        found |= ends_with(file, ".bin") || ends_with(file, ".manifest");
+    }
+    closedir(dir);
+
+    return found;
+}
+
+// appends the start of a log record to every log and the start of a value
+// record to every values file: writes the crash cut short, never
+// acknowledged
+void tear_tails(const TortureEnv& env, std::mt19937_64& rng)
+{
+    std::string record;
+    NCodec::Codec<std::string>::write(record, env.ns);
+    NCodec::append_record(record, make_key(0), uint64_t(0));
+
+    std::string value;
+    NCodec::Codec<uint64_t>::write(value, uint64_t(env.value_size));
+    value += make_value(1, env.value_size);
+
+    DIR* dir = opendir(".");
+    VERIFY(dir, "failed to open the data directory");
+    while (auto* entry = readdir(dir)) {
+        const std::string file = entry->d_name;
+
+        std::string_view tail;
+        if (ends_with(file, "wal.bin")) {
+            tail = record;
+        } else if (file.find("values.") != std::string::npos
+                && ends_with(file, ".bin"))
+        {
+            tail = value;
+        } else {
+            continue;
+        }
+
+        // at least a byte, never the whole record
+        tail = tail.substr(0, 1 + rng() % (tail.size() - 1));
+
+        const int fd = open(file.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+        if (fd != -1) {
+            NCodec::write_all(fd, tail);
+            close(fd);
+        }
+    }
+    closedir(dir);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// time from the start until the server answers a request, nullopt if it
+// exited or did not answer in time
+std::optional<int64_t> wait_ready(
+    const TortureEnv& env,
+    int port,
+    pid_t pid,
+    Clock::time_point started)
+{
+    const auto deadline = started
+        + std::chrono::milliseconds(env.recovery_timeout_ms);
+
+    while (Clock::now() < deadline) {
+        int status = 0;
+        if (waitpid(pid, &status, WNOHANG) == pid) {
+            LOG_ERROR_S("the server exited on start, see " << server_log);
+            return std::nullopt;
+        }
+
+        const int fd = connect_to(port);
+        if (fd != -1) {
+            const auto request = get_request(env, 0, 0);
+            char message_type = 0;
+            std::string payload;
+            const bool answered = send_all(fd, request.view())
+                && read_response(fd, message_type, payload);
+            close(fd);
+
+            if (answered) {
+                return std::chrono::duration_cast<std::chrono::milliseconds>(
+                    Clock::now() - started).count();
+            }
+        }
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(ready_poll_ms));
+    }
+
+    LOG_ERROR_S("the server did not answer within "
+        << env.recovery_timeout_ms << " ms");
+    return std::nullopt;
+}
+
+struct VerifyResult
+{
+    // acknowledged puts the server does not have
+    uint64_t lost = 0;
+    // values no put wrote
+    uint64_t unexpected = 0;
+    bool failed = false;
+};
+
+// reads every key back, a key may hold its last acknowledged version or any
+// later one that was in flight; what it holds becomes the new state
+VerifyResult verify(
+    const TortureEnv& env,
+    int port,
+    std::vector<KeyState>& keys)
+{
+    VerifyResult result;
+
+    const int fd = connect_to(port);
+    if (fd == -1) {
+        result.failed = true;
+        return result;
+    }
+
+    for (int first = 0; first < env.keys; first += verify_batch) {
+        const int last = std::min(env.keys, first + verify_batch);
+
+        std::string requests;
+        for (int i = first; i < last; ++i) {
+            requests += get_request(env, i, i).view();
+        }
+        if (!send_all(fd, requests)) {
+            result.failed = true;
+            break;
+        }
+
+        char message_type = 0;
+        std::string payload;
+        for (int n = first; n < last; ++n) {
+            NProto::TGetResponse response;
+            if (!read_response(fd, message_type, payload)
+                    || message_type != GET_RESPONSE
+                    || !response.ParseFromString(payload)
+                    || response.request_id() < uint64_t(first)
+                    || response.request_id() >= uint64_t(last))
+            {
+                result.failed = true;
+                break;
+            }
+
+            const int i = response.request_id();
+            auto& state = keys[i];
+            const auto version = version_of(response.offset());
+            if (!version || *version > state.sent) {
+                ++result.unexpected;
+                LOG_ERROR_S(make_key(i) << ": unexpected value '"
+                    << response.offset().substr(0, 32) << "'");
+                continue;
+            }
+
+            if (*version < state.acked) {
+                ++result.lost;
+                LOG_ERROR_S(make_key(i) << ": acknowledged version "
+                    << state.acked << " lost, found " << *version);
+            }
+
+            state.acked = state.sent = *version;
+        }
+
+        if (result.failed) {
+            break;
+        }
+    }
+
+    close(fd);
+    return result;
+}
+
+// puts DEPTH random keys at a time, a key may repeat within a batch, until
+// the server is gone; returns the number of acknowledged puts
+uint64_t write_until_killed(
+    const TortureEnv& env,
+    int port,
+    std::vector<KeyState>& keys,
+    std::mt19937_64& rng)
+{
+    const int fd = connect_to(port);
+    if (fd == -1) {
+        return 0;
+    }
+
+    uint64_t acked = 0;
+    uint64_t request_id = 0;
+
+    // request_id - first_id -> key and version of the batch in flight
+    std::vector<std::pair<int, uint64_t>> batch;
+    while (true) {
+        const uint64_t first_id = request_id;
+        batch.clear();
+
+        std::string requests;
+        while (int(batch.size()) < env.depth) {
+            const int i = rng() % env.keys;
+            const auto version = ++keys[i].sent;
+            batch.emplace_back(i, version);
+
+            NProto::TPutRequest request;
+            request.set_request_id(request_id++);
+            request.set_key(make_key(i));
+            request.set_ns(env.ns);
+            request.set_offset(make_value(version, env.value_size));
+            requests += serialize_message(PUT_REQUEST, request).view();
+        }
+
+        if (!send_all(fd, requests)) {
+            break;
+        }
+
+        char message_type = 0;
+        std::string payload;
+        bool alive = true;
+        for (size_t n = 0; n < batch.size(); ++n) {
+            NProto::TPutResponse response;
+            if (!read_response(fd, message_type, payload)) {
+                alive = false;
+                break;
+            }
+
+            VERIFY(message_type == PUT_RESPONSE
+                    && response.ParseFromString(payload)
+                    && response.request_id() >= first_id
+                    && response.request_id() < request_id,
+                "unexpected response");
+
+            // acks may come in any order, the server must end up with the
+            // latest acknowledged version (or a later one in flight)
+            const auto [i, version] = batch[response.request_id() - first_id];
+            auto& state = keys[i];
+            state.acked = std::max(state.acked, version);
+            ++acked;
+        }
+
+        if (!alive) {
+            break;
+        }
+    }
+
+    close(fd);
+    return acked;
+}
+
+void stop_server(pid_t pid, int signal)
+{
+    kill(pid, signal);
+    int status = 0;
+    waitpid(pid, &status, 0);
+}
+
+}   // namespace
+
+////////////////////////////////////////////////////////////////////////////////
+
+/*
+ * crash-recovery torture test: runs the server in the current directory
+ * (which must have no data yet), puts to it and kills it with SIGKILL at a
+ * random point, then restarts it and checks that every acknowledged put is
+ * there; reports the recovery time against the data size of every round,
+ * the server gets this process's environment (MODE, THREADS, NAMESPACES, ...)
+ */
+int main(int argc, const char** argv)
+{
+    if (argc < 3) {
+        LOG_ERROR_S("usage: crashtest <server binary> <port> [rounds]");
+        return 1;
+    }
+
+    const TortureEnv env;
+    const std::string server = argv[1];
+    const int port = atoi(argv[2]);
+    const int rounds = argc >= 4 ? atoi(argv[3]) : 10;
+
+    if (has_data()) {
+        LOG_ERROR_S("run crashtest in an empty directory");
+        return 1;
+    }
+
+    LOG_INFO_S("seed " << env.seed);
+    std::mt19937_64 rng(env.seed);
+    std::uniform_int_distribution<int> kill_after(
+        env.kill_min_ms,
+        env.kill_max_ms);
+
+    std::vector<KeyState> keys(env.keys);
+    uint64_t total_acked = 0;
+    uint64_t total_lost = 0;
+    uint64_t total_unexpected = 0;
+
+    // the last round only recovers and checks
+    for (int round = 0; round <= rounds; ++round) {
+        const auto size = data_size();
+        const auto started = Clock::now();
+        const pid_t pid = start_server(server, port);
+
+        const auto recovery_ms = wait_ready(env, port, pid, started);
+        if (!recovery_ms) {
+            stop_server(pid, SIGKILL);
+            return 1;
+        }
+
+        const auto result = verify(env, port, keys);
+        total_lost += result.lost;
+        total_unexpected += result.unexpected;
+        if (result.failed) {
+            LOG_ERROR_S("round " << round << ": the server failed to "
+                "answer the verification gets");
+            stop_server(pid, SIGKILL);
+            return 1;
+        }
+
+        LOG_INFO_S("round " << round
+            << ": data " << size << " bytes"
+            << ", recovered in " << *recovery_ms << " ms"
+            << ", lost " << result.lost
+            << ", unexpected " << result.unexpected);
+
+        if (round == rounds) {
+            stop_server(pid, SIGTERM);
+            break;
+        }
+
+        const auto delay = std::chrono::milliseconds(kill_after(rng));
+        std::thread killer([pid, delay] () {
+            std::this_thread::sleep_for(delay);
+            kill(pid, SIGKILL);
+        });
+
+        const auto acked = write_until_killed(env, port, keys, rng);
+        killer.join();
+        stop_server(pid, SIGKILL);
+        total_acked += acked;
+
+        LOG_INFO_S("round " << round << ": killed after "
+            << delay.count() << " ms, " << acked << " acknowledged puts");
+
+        if (env.torn) {
+            tear_tails(env, rng);
+        }
+    }
+
+    LOG_INFO_S(rounds << " crashes, " << total_acked
+        << " acknowledged puts, " << total_lost << " lost, "
+        << total_unexpected << " unexpected values");
+
+    return total_lost || total_unexpected ? 1 : 0;
+}
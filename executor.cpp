@@ -0,0 +1,261 @@
+#include "executor.h"
+
+#include "log.h"
+
+namespace NExecutor {
+
+namespace {
+
+////////////////////////////////////////////////////////////////////////////////
+
+constexpr int64_t initial_deque_size = 256;
+
+// attempts to find work before a worker goes to sleep
+constexpr int idle_spins = 64;
+
+// index of the worker owning the current thread, -1 outside of the pool
+thread_local int current_worker = -1;
+thread_local const void* current_executor = nullptr;
+
+uint64_t next_random(uint64_t& seed)
+{
+    // xorshift64
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    return seed;
+}
+
+}   // namespace
+
+////////////////////////////////////////////////////////////////////////////////
+
+WorkStealingDeque::WorkStealingDeque()
+{
+    Arrays.push_back(std::make_unique<Array>(initial_deque_size));
+    Buffer.store(Arrays.back().get(), std::memory_order_relaxed);
+}
+
+void WorkStealingDeque::push(Task* task)
+{
+    const auto b = Bottom.load(std::memory_order_relaxed);
+    const auto t = Top.load(std::memory_order_acquire);
+    auto* a = Buffer.load(std::memory_order_relaxed);
+
+    if (b - t > a->size - 1) {
+        Arrays.push_back(std::make_unique<Array>(a->size * 2));
+        auto* grown = Arrays.back().get();
+        for (auto i = t; i < b; ++i) {
+            grown->put(i, a->get(i));
+        }
+
+        Buffer.store(grown, std::memory_order_release);
+        a = grown;
+    }
+
+    a->put(b, task);
+    std::atomic_thread_fence(std::memory_order_release);
+    Bottom.store(b + 1, std::memory_order_relaxed);
+}
+
+Task* WorkStealingDeque::pop()
+{
+    const auto b = Bottom.load(std::memory_order_relaxed) - 1;
+    auto* a = Buffer.load(std::memory_order_relaxed);
+    Bottom.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    auto t = Top.load(std::memory_order_relaxed);
+
+    if (t > b) {
+        Bottom.store(b + 1, std::memory_order_relaxed);
+        return nullptr;
+    }
+
+    auto* task = a->get(b);
+    if (t == b) {
+        // last element, race against thieves
+        if (!Top.compare_exchange_strong(
+                t, t + 1,
+                std::memory_order_seq_cst,
+                std::memory_order_relaxed))
+        {
+            task = nullptr;
+        }
+
+        Bottom.store(b + 1, std::memory_order_relaxed);
+    }
+
+    return task;
+}
+
+Task* WorkStealingDeque::steal()
+{
+    auto t = Top.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    const auto b = Bottom.load(std::memory_order_acquire);
+
+    if (t >= b) {
+        return nullptr;
+    }
+
+    auto* a = Buffer.load(std::memory_order_acquire);
+    auto* task = a->get(t);
+    if (!Top.compare_exchange_strong(
+            t, t + 1,
+            std::memory_order_seq_cst,
+            std::memory_order_relaxed))
+    {
+        return nullptr;
+    }
+
+    return task;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+Executor::Executor(int workers, Task on_start)
+{
+    VERIFY(workers > 0, "invalid worker count");
+
+    for (int i = 0; i < workers; ++i) {
+        Workers.push_back(std::make_unique<Worker>());
+    }
+
+    // started after all deques exist, workers steal from each other
+    for (int i = 0; i < workers; ++i) {
+        Workers[i]->thread = std::thread([this, i, on_start] () {
+            run_worker(i, on_start);
+        });
+    }
+}
+
+Executor::~Executor()
+{
+    {
+        std::lock_guard<std::mutex> guard(SleepMutex);
+        Stopping = true;
+    }
+    Wakeup.notify_all();
+
+    for (auto& worker: Workers) {
+        worker->thread.join();
+    }
+
+    // tasks that were never started
+    for (auto* task: Injected) {
+        delete task;
+    }
+    for (auto* task: Background) {
+        delete task;
+    }
+    for (auto& worker: Workers) {
+        while (auto* task = worker->tasks.pop()) {
+            delete task;
+        }
+    }
+}
+
+void Executor::submit(Task task, EPriority priority)
+{
+    auto* heap_task = new Task(std::move(task));
+
+    if (priority == EPriority::BACKGROUND) {
+        std::lock_guard<std::mutex> guard(InjectedMutex);
+        Background.push_back(heap_task);
+    } else if (current_executor == this) {
+        Workers[current_worker]->tasks.push(heap_task);
+    } else {
+        std::lock_guard<std::mutex> guard(InjectedMutex);
+        Injected.push_back(heap_task);
+    }
+
+    // pairs with the Sleeping increment in run_worker: either the sleeper
+    // sees the new task or we see the sleeper
+    Pending.fetch_add(1, std::memory_order_seq_cst);
+    if (Sleeping.load(std::memory_order_seq_cst) > 0) {
+        std::lock_guard<std::mutex> guard(SleepMutex);
+        Wakeup.notify_one();
+    }
+}
+
+Task* Executor::find_task(int index, uint64_t& seed)
+{
+    if (auto* task = Workers[index]->tasks.pop()) {
+        return task;
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(InjectedMutex);
+        if (!Injected.empty()) {
+            auto* task = Injected.front();
+            Injected.pop_front();
+            return task;
+        }
+    }
+
+    const int n = Workers.size();
+    const int start = next_random(seed) % n;
+    for (int i = 0; i < n; ++i) {
+        const int victim = (start + i) % n;
+        if (victim == index) {
+            continue;
+        }
+
+        if (auto* task = Workers[victim]->tasks.steal()) {
+            Steals.fetch_add(1, std::memory_order_relaxed);
+            return task;
+        }
+    }
+
+    std::lock_guard<std::mutex> guard(InjectedMutex);
+    if (!Background.empty()) {
+        auto* task = Background.front();
+        Background.pop_front();
+        return task;
+    }
+
+    return nullptr;
+}
+
+void Executor::run_worker(int index, const Task& on_start)
+{
+    current_worker = index;
+    current_executor = this;
+
+    if (on_start) {
+        on_start();
+    }
+
+    uint64_t seed = 0x9e3779b97f4a7c15ULL * (index + 1);
+    int spins = 0;
+
+    while (true) {
+        if (auto* task = find_task(index, seed)) {
+            Pending.fetch_sub(1, std::memory_order_relaxed);
+            spins = 0;
+
+            (*task)();
+            delete task;
+            continue;
+        }
+
+        if (++spins < idle_spins) {
+            std::this_thread::yield();
+            continue;
+        }
+
+        std::unique_lock<std::mutex> guard(SleepMutex);
+        Sleeping.fetch_add(1, std::memory_order_seq_cst);
+        Wakeup.wait(guard, [this] () {
+            return Stopping || Pending.load(std::memory_order_seq_cst) > 0;
+        });
+        Sleeping.fetch_sub(1, std::memory_order_seq_cst);
+        spins = 0;
+
+        if (Stopping) {
+            return;
+        }
+    }
+}
+
+}   // namespace NExecutor
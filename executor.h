@@ -0,0 +1,125 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace NExecutor {
+
+////////////////////////////////////////////////////////////////////////////////
+
+using Task = std::function<void()>;
+
+enum class EPriority
+{
+    // request handling
+    FOREGROUND,
+    // checkpoints and other maintenance, runs only when no foreground task
+    // is waiting
+    BACKGROUND,
+};
+
+// Chase-Lev deque: the owner pushes and pops at the bottom, thieves steal
+// from the top; the buffer grows and retired buffers live until destruction
+class WorkStealingDeque
+{
+private:
+    struct Array
+    {
+        const int64_t size;
+        std::unique_ptr<std::atomic<Task*>[]> slots;
+
+        explicit Array(int64_t size)
+            : size(size)
+            , slots(new std::atomic<Task*>[size])
+        {
+        }
+
+        Task* get(int64_t i) const
+        {
+            return slots[i & (size - 1)].load(std::memory_order_relaxed);
+        }
+
+        void put(int64_t i, Task* task)
+        {
+            slots[i & (size - 1)].store(task, std::memory_order_relaxed);
+        }
+    };
+
+    alignas(64) std::atomic<int64_t> Top{0};
+    alignas(64) std::atomic<int64_t> Bottom{0};
+    std::atomic<Array*> Buffer;
+    // owner only
+    std::vector<std::unique_ptr<Array>> Arrays;
+
+public:
+    WorkStealingDeque();
+
+    // owner only
+    void push(Task* task);
+    Task* pop();
+
+    // any thread
+    Task* steal();
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+// pool of workers, each with its own deque; idle workers steal from the
+// others so that skewed work does not pile up behind one busy worker
+class Executor
+{
+private:
+    struct Worker
+    {
+        WorkStealingDeque tasks;
+        std::thread thread;
+    };
+
+    std::vector<std::unique_ptr<Worker>> Workers;
+
+    // submissions from threads outside of the pool
+    std::mutex InjectedMutex;
+    std::deque<Task*> Injected;
+    std::deque<Task*> Background;
+
+    std::mutex SleepMutex;
+    std::condition_variable Wakeup;
+    std::atomic<int64_t> Pending{0};
+    std::atomic<int> Sleeping{0};
+    std::atomic<bool> Stopping{false};
+
+    std::atomic<uint64_t> Steals{0};
+
+public:
+    // on_start runs first on every worker thread, e.g. to mark it for the
+    // io limiter
+    explicit Executor(int workers, Task on_start = {});
+    ~Executor();
+
+    // thread-safe, foreground tasks submitted from a worker go to its own
+    // deque, background tasks to a shared queue served last
+    void submit(Task task, EPriority priority = EPriority::FOREGROUND);
+
+    int worker_count() const
+    {
+        return Workers.size();
+    }
+
+    uint64_t steal_count() const
+    {
+        return Steals.load(std::memory_order_relaxed);
+    }
+
+private:
+    void run_worker(int index, const Task& on_start);
+    Task* find_task(int index, uint64_t& seed);
+};
+
+}   // namespace NExecutor
@@ -0,0 +1,121 @@
+#include "iolimit.h"
+
+#include "stats.h"
+
+#include <algorithm>
+#include <thread>
+
+namespace NIoLimit {
+
+namespace {
+
+////////////////////////////////////////////////////////////////////////////////
+
+NStats::Counter& rate_gauge = NStats::counter("background_io_rate");
+// time background writers spent waiting for the budget
+NStats::Counter& throttled_us_counter = NStats::counter("background_io_throttled_us");
+// waits skipped because they were due on a request serving thread
+NStats::Counter& unthrottled_counter = NStats::counter("background_io_unthrottled");
+
+thread_local bool waiting_forbidden = false;
+
+}   // namespace
+
+////////////////////////////////////////////////////////////////////////////////
+
+TokenBucket::TokenBucket(uint64_t rate, uint64_t burst)
+    : Rate(rate)
+    , Burst(burst)
+    , Tokens(burst)
+{
+    rate_gauge.set(Rate);
+}
+
+void TokenBucket::set_rate(uint64_t rate)
+{
+    std::lock_guard<std::mutex> guard(Mutex);
+    Rate = rate;
+    rate_gauge.set(Rate);
+}
+
+void TokenBucket::enable_tuning(uint64_t min_rate, uint64_t target_us)
+{
+    std::lock_guard<std::mutex> guard(Mutex);
+    if (!Rate) {
+        // nothing to tune
+        return;
+    }
+
+    MinRate = std::clamp<uint64_t>(min_rate, 1, Rate);
+    MaxRate = Rate;
+    TargetUs = target_us;
+}
+
+void TokenBucket::tune(Clock::time_point now)
+{
+    if (!TargetUs || now - LastTune < tune_interval) {
+        return;
+    }
+    LastTune = now;
+
+    const auto reads = Reads.exchange(0, std::memory_order_relaxed);
+    const auto read_ns = ReadNs.exchange(0, std::memory_order_relaxed);
+
+    if (reads && read_ns / reads > TargetUs * 1000) {
+        Rate = std::max(MinRate, Rate / 2);
+    } else {
+        Rate = std::min(MaxRate, Rate + std::max<uint64_t>(Rate / 4, 1));
+    }
+
+    rate_gauge.set(Rate);
+}
+
+uint64_t TokenBucket::rate() const
+{
+    std::lock_guard<std::mutex> guard(Mutex);
+    return Rate;
+}
+
+void TokenBucket::acquire(uint64_t bytes)
+{
+    std::chrono::duration<double> wait{0};
+
+    {
+        std::lock_guard<std::mutex> guard(Mutex);
+        if (!Rate) {
+            return;
+        }
+
+        const auto now = Clock::now();
+        tune(now);
+
+        const std::chrono::duration<double> elapsed = now - Last;
+        Last = now;
+
+        Tokens = std::min<double>(Tokens + elapsed.count() * Rate, Burst);
+        Tokens -= bytes;
+
+        if (Tokens < 0) {
+            wait = std::chrono::duration<double>(-Tokens / Rate);
+        }
+    }
+
+    if (wait.count() > 0) {
+        if (waiting_forbidden) {
+            unthrottled_counter.add(1);
+            return;
+        }
+
+        throttled_us_counter.add(wait.count() * 1e6);
+        std::this_thread::sleep_for(wait);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void forbid_waiting_on_current_thread()
+{
+    waiting_forbidden = true;
+}
+
+}   // namespace NIoLimit
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+
+namespace NIoLimit {
+
+////////////////////////////////////////////////////////////////////////////////
+
+// byte budget for background io shared by all threads: acquire takes the
+// bytes right away and, if the budget is exhausted, sleeps until the debt is
+// paid off at the current rate; a 0 rate means unlimited
+//
+// with tuning enabled the rate moves between min_rate and the initial rate:
+// it is halved while foreground reads are slower than the target on average
+// and grows back by a quarter otherwise, re-evaluated every tune_interval
+// while background io is going on
+class TokenBucket
+{
+private:
+    using Clock = std::chrono::steady_clock;
+
+    mutable std::mutex Mutex;
+    uint64_t Rate = 0;
+    // unused budget accumulates up to this many bytes
+    uint64_t Burst = 0;
+    double Tokens = 0;
+    Clock::time_point Last = Clock::now();
+
+    uint64_t MinRate = 0;
+    uint64_t MaxRate = 0;
+    // 0 disables tuning
+    uint64_t TargetUs = 0;
+    Clock::time_point LastTune = Clock::now();
+
+    // foreground reads since LastTune
+    std::atomic<uint64_t> ReadNs{0};
+    std::atomic<uint64_t> Reads{0};
+
+public:
+    static constexpr auto tune_interval = std::chrono::milliseconds(100);
+
+    TokenBucket(uint64_t rate, uint64_t burst);
+
+    void set_rate(uint64_t rate);
+    uint64_t rate() const;
+
+    // target_us is the acceptable mean foreground read latency
+    void enable_tuning(uint64_t min_rate, uint64_t target_us);
+
+    // thread-safe and lock-free, called by foreground readers
+    void observe_foreground(std::chrono::nanoseconds latency)
+    {
+        ReadNs.fetch_add(latency.count(), std::memory_order_relaxed);
+        Reads.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // sleeps off the debt unless the calling thread must not wait
+    void acquire(uint64_t bytes);
+
+private:
+    void tune(Clock::time_point now);
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+// marks the calling thread as one that serves requests (a reactor or an
+// executor worker): its acquire calls take the bytes but leave the debt to
+// the background threads instead of sleeping, so a background write that
+// ends up on such a thread never stalls it
+void forbid_waiting_on_current_thread();
+
+}   // namespace NIoLimit
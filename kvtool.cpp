@@ -0,0 +1,1211 @@
+#include "checkpoint.h"
+#include "codec.h"
+#include "log.h"
+#include "snapshot.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iomanip>
+#include <optional>
+#include <set>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+using namespace NLogging;
+
+namespace {
+
+////////////////////////////////////////////////////////////////////////////////
+
+// values are read and written in chunks of this many bytes
+constexpr size_t io_chunk = 4 * 1024 * 1024;
+
+constexpr size_t fixed_key_size = sizeof(NCodec::Key16);
+
+struct ToolEnv
+{
+    // namespaces processed in parallel
+    int threads = std::max(1u, std::thread::hardware_concurrency());
+
+    // key mode of the data directory, the server's KEY_SIZE
+    size_t key_size = 0;
+
+    // the server's THREADS for a shared-nothing directory, 0 otherwise;
+    // restore distributes the keys among the shards by it
+    int shards = 0;
+
+    ToolEnv()
+    {
+        if (auto value = std::getenv("THREADS")) {
+            threads = atoi(value);
+            VERIFY(threads > 0, "invalid THREADS");
+        }
+
+        if (auto value = std::getenv("KEY_SIZE")) {
+            key_size = strtoull(value, nullptr, 10);
+            VERIFY(key_size == 0 || key_size == fixed_key_size,
+                "invalid KEY_SIZE");
+        }
+
+        if (auto value = std::getenv("SHARDS")) {
+            shards = atoi(value);
+            VERIFY(shards >= 0, "invalid SHARDS");
+        }
+    }
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+// the write-ahead logs of a storage in replay order: the sealed one, then
+// the current one
+std::vector<std::string> log_paths(const std::string& storage)
+{
+    return {storage + "wal.old.bin", storage + "wal.bin"};
+}
+
+// one namespace of one storage: the whole directory, or a shard ("shardN.")
+// of a shared-nothing server; the file names are the server's
+struct Unit
+{
+    std::string storage;
+    std::string name;
+
+    std::string file(const std::string& suffix) const
+    {
+        return storage + (name.empty() ? "" : name + ".") + suffix;
+    }
+
+    // of the checkpoint files (NCheckpoint)
+    std::string prefix() const
+    {
+        return file("");
+    }
+
+    std::vector<std::string> wal_paths() const
+    {
+        return log_paths(storage);
+    }
+
+    std::string title() const
+    {
+        return file("values.bin");
+    }
+
+    bool operator<(const Unit& other) const
+    {
+        return std::tie(storage, name) < std::tie(other.storage, other.name);
+    }
+};
+
+bool ends_with(std::string_view s, std::string_view suffix)
+{
+    return s.size() >= suffix.size()
+        && s.substr(s.size() - suffix.size()) == suffix;
+}
+
+// "shardN." at the front of a file name, empty if there is none
+std::string_view storage_of(std::string_view file)
+{
+    if (file.substr(0, 5) != "shard") {
+        return {};
+    }
+
+    size_t i = 5;
+    while (i < file.size() && isdigit(file[i])) {
+        ++i;
+    }
+
+    if (i == 5 || i == file.size() || file[i] != '.') {
+        return {};
+    }
+
+    return file.substr(0, i + 1);
+}
+
+// the namespaces of the data directory in the current directory, found by
+// their checkpoint manifest, legacy checkpoint and values files; a namespace
+// named like a shard is taken for one
+std::vector<Unit> discover()
+{
+    std::set<Unit> units;
+
+    DIR* dir = opendir(".");
+    VERIFY(dir, "failed to open the data directory");
+    while (auto* entry = readdir(dir)) {
+        std::string_view file = entry->d_name;
+
+        std::string_view rest;
+        if (ends_with(file, "values.bin")) {
+            rest = file.substr(0, file.size() - 10);
+        } else if (ends_with(file, "db.manifest")) {
+            rest = file.substr(0, file.size() - 11);
+        } else if (ends_with(file, "db.bin")) {
+            rest = file.substr(0, file.size() - 6);
+        } else {
+            continue;
+        }
+
+        Unit unit;
+        unit.storage = storage_of(rest);
+        rest.remove_prefix(unit.storage.size());
+        if (!rest.empty()) {
+            if (rest.back() != '.') {
+                continue;
+            }
+            unit.name = rest.substr(0, rest.size() - 1);
+        }
+
+        units.insert(std::move(unit));
+    }
+    closedir(dir);
+
+    return {units.begin(), units.end()};
+}
+
+// the storages of units, i.e. their write-ahead logs
+std::vector<std::string> storages_of(const std::vector<Unit>& units)
+{
+    std::set<std::string> storages;
+    for (const auto& unit: units) {
+        storages.insert(unit.storage);
+    }
+
+    return {storages.begin(), storages.end()};
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// nullopt if the bytes do not fit a fixed-size key
+template<class TKey>
+std::optional<TKey> key_of(std::string_view bytes)
+{
+    if constexpr (std::is_same_v<TKey, NCodec::Key16>) {
+        if (bytes.size() != sizeof(NCodec::Key16)) {
+            return std::nullopt;
+        }
+
+        NCodec::Key16 key;
+        memcpy(&key, bytes.data(), sizeof(key));
+        return key;
+    } else {
+        return std::string(bytes);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// name, key, offset: one record of a storage's write-ahead log
+template<class TKey, class TFunc>
+size_t read_log(std::string_view in, TFunc&& func)
+{
+    const auto size = in.size();
+
+    std::string name;
+    TKey key{};
+    uint64_t offset = 0;
+    while (true) {
+        auto rest = in;
+        if (!NCodec::Codec<std::string>::read(rest, name)
+                || !NCodec::Codec<TKey>::read(rest, key)
+                || !NCodec::Codec<uint64_t>::read(rest, offset))
+        {
+            break;
+        }
+
+        func(name, key, offset);
+        in = rest;
+    }
+
+    return size - in.size();
+}
+
+// what the server recovers for a namespace: its checkpoint plus its records
+// in the storage's log
+template<class TKey>
+struct Index
+{
+    std::unordered_map<TKey, uint64_t> offsets;
+    NCheckpoint::Manifest manifest;
+    // bytes of the checkpoint partitions that do not form a record, missing
+    // ones included
+    uint64_t torn_bytes = 0;
+    uint64_t log_records = 0;
+};
+
+template<class TKey>
+Index<TKey> load_index(const Unit& unit)
+{
+    Index<TKey> index;
+
+    index.manifest = NCheckpoint::read_manifest(unit.prefix());
+    for (const auto& partition: index.manifest.partitions) {
+        const auto checkpoint = NCodec::read_file(partition.file);
+        const auto consumed = NCodec::read_records<TKey, uint64_t>(
+            checkpoint,
+            [&] (const TKey& key, uint64_t offset) {
+                index.offsets[key] = offset;
+            });
+        // a partition shorter than its manifest entry is torn as well
+        index.torn_bytes +=
+            std::max<uint64_t>(checkpoint.size(), partition.bytes) - consumed;
+    }
+
+    for (const auto& path: unit.wal_paths()) {
+        read_log<TKey>(
+            NCodec::read_file(path),
+            [&] (const std::string& name, const TKey& key, uint64_t offset) {
+                if (name == unit.name) {
+                    index.offsets[key] = offset;
+                    ++index.log_records;
+                }
+            });
+    }
+
+    return index;
+}
+
+// the index entries in values file order
+template<class TKey>
+std::vector<std::pair<uint64_t, const TKey*>> by_offset(
+    const Index<TKey>& index)
+{
+    std::vector<std::pair<uint64_t, const TKey*>> entries;
+    entries.reserve(index.offsets.size());
+    for (const auto& [key, offset]: index.offsets) {
+        entries.emplace_back(offset, &key);
+    }
+
+    std::sort(entries.begin(), entries.end());
+    return entries;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// reads the records of a values file at increasing offsets through a large
+// window, i.e. sequentially, skipping over the dead ones
+class ValueReader
+{
+private:
+    int Fd = -1;
+    uint64_t Size = 0;
+    std::string Window;
+    uint64_t WindowStart = 0;
+
+public:
+    explicit ValueReader(const std::string& path)
+    {
+        Fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (Fd == -1) {
+            return;
+        }
+
+        struct stat st;
+        if (fstat(Fd, &st) == 0) {
+            Size = st.st_size;
+        }
+        posix_fadvise(Fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+
+    ~ValueReader()
+    {
+        if (Fd != -1) {
+            close(Fd);
+        }
+    }
+
+    uint64_t size() const
+    {
+        return Size;
+    }
+
+    // the value of the record at offset, nullopt if the record is not
+    // complete; valid until the next call
+    std::optional<std::string_view> read(uint64_t offset)
+    {
+        auto header = bytes(offset, sizeof(uint64_t));
+        if (!header) {
+            return std::nullopt;
+        }
+
+        uint64_t sz = 0;
+        memcpy(&sz, header->data(), sizeof(sz));
+        return bytes(offset + sizeof(uint64_t), sz);
+    }
+
+    // bytes of the record at offset, header included
+    static uint64_t record_size(std::string_view value)
+    {
+        return sizeof(uint64_t) + value.size();
+    }
+
+private:
+    std::optional<std::string_view> bytes(uint64_t offset, uint64_t len)
+    {
+        if (offset > Size || len > Size - offset) {
+            return std::nullopt;
+        }
+
+        if (offset < WindowStart
+                || offset + len > WindowStart + Window.size())
+        {
+            WindowStart = offset;
+            Window.resize(std::min(
+                std::max<uint64_t>(len, io_chunk),
+                Size - offset));
+
+            size_t filled = 0;
+            while (filled < Window.size()) {
+                const auto n = pread(
+                    Fd,
+                    &Window[filled],
+                    Window.size() - filled,
+                    offset + filled);
+                if (n < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (n <= 0) {
+                    Window.clear();
+                    return std::nullopt;
+                }
+                filled += n;
+            }
+        }
+
+        return std::string_view(Window).substr(offset - WindowStart, len);
+    }
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+// fsyncs and closes fd, false on error
+bool sync_close(int fd)
+{
+    const bool ok = fsync(fd) == 0;
+    return close(fd) == 0 && ok;
+}
+
+// makes renames in the current directory durable
+void sync_directory()
+{
+    const int fd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd != -1) {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+// writes data to path + ".tmp" and fsyncs it, renamed by the caller
+bool write_temp(const std::string& path, std::string_view data)
+{
+    const int fd = open(
+        (path + ".tmp").c_str(),
+        O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+        0644);
+    if (fd == -1) {
+        return false;
+    }
+
+    const bool ok = NCodec::write_all(fd, data);
+    return sync_close(fd) && ok;
+}
+
+bool commit_temp(const std::string& path)
+{
+    return rename((path + ".tmp").c_str(), path.c_str()) == 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+enum class ECommand
+{
+    STATS,
+    VERIFY,
+    COMPACT,
+};
+
+struct Report
+{
+    Unit unit;
+    uint64_t keys = 0;
+    // bytes of the records the index points to vs the values file size
+    uint64_t live_bytes = 0;
+    uint64_t file_bytes = 0;
+    uint64_t torn_bytes = 0;
+    uint64_t log_records = 0;
+    // keys pointing at a missing, truncated or overlapping record
+    uint64_t broken = 0;
+    bool failed = false;
+};
+
+// scans the live records of a namespace in file order, verification only
+// checks their framing: the records have no checksums, so a value whose
+// bytes were flipped in place passes; compaction copies them into a values
+// file of the next generation and commits a checkpoint naming it, the
+// caller has emptied the storage's logs before (fold()), so no log record
+// points into the old values file; broken keys are dropped, the server
+// would not find their values either
+template<class TKey>
+Report process(const Unit& unit, ECommand command)
+{
+    Report report;
+    report.unit = unit;
+
+    const auto index = load_index<TKey>(unit);
+    report.keys = index.offsets.size();
+    report.torn_bytes = index.torn_bytes;
+    report.log_records = index.log_records;
+
+    ValueReader reader(index.manifest.values);
+    report.file_bytes = reader.size();
+
+    const bool compact = command == ECommand::COMPACT;
+
+    NCheckpoint::Manifest manifest;
+    manifest.generation = index.manifest.generation + 1;
+    manifest.values = NCheckpoint::values_path(
+        unit.prefix(),
+        manifest.generation);
+    manifest.partitions.resize(1);
+    auto& partition = manifest.partitions[0];
+    partition.file = NCheckpoint::partition_path(
+        unit.prefix(),
+        manifest.generation,
+        0);
+
+    int values_fd = -1;
+    int db_fd = -1;
+    if (compact) {
+        const int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+        values_fd = open(manifest.values.c_str(), flags, 0644);
+        db_fd = open(partition.file.c_str(), flags, 0644);
+        VERIFY(values_fd != -1 && db_fd != -1, "failed to open output files");
+    }
+
+    std::string values;
+    std::string checkpoint;
+    uint64_t out_offset = 0;
+    bool write_failed = false;
+    auto write = [&] (bool last) {
+        if (values.size() >= io_chunk || last) {
+            write_failed |= !NCodec::write_all(values_fd, values);
+            values.clear();
+        }
+        if (checkpoint.size() >= io_chunk || last) {
+            write_failed |= !NCodec::write_all(db_fd, checkpoint);
+            partition.bytes += checkpoint.size();
+            checkpoint.clear();
+        }
+    };
+
+    uint64_t prev_offset = 0;
+    uint64_t prev_end = 0;
+    for (const auto& [offset, key]: by_offset(index)) {
+        // keys may share a record, records may not overlap
+        const bool overlaps = offset < prev_end && offset != prev_offset;
+        const auto value = reader.read(offset);
+        if (!value || overlaps) {
+            ++report.broken;
+            continue;
+        }
+
+        const auto size = ValueReader::record_size(*value);
+        if (offset != prev_offset || prev_end == 0) {
+            report.live_bytes += size;
+        }
+        prev_offset = offset;
+        prev_end = offset + size;
+
+        if (!compact) {
+            continue;
+        }
+
+        NCodec::Codec<uint64_t>::write(values, value->size());
+        values.append(*value);
+        NCodec::append_record(checkpoint, *key, out_offset);
+        ++partition.records;
+        out_offset += size;
+        write(false);
+    }
+
+    if (!compact) {
+        return report;
+    }
+
+    write(true);
+    write_failed |= !sync_close(values_fd);
+    write_failed |= !sync_close(db_fd);
+
+    // the manifest switches the checkpoint and the values file at once
+    if (write_failed
+            || !NCheckpoint::commit_manifest(unit.prefix(), manifest))
+    {
+        LOG_ERROR_S("failed to write the compacted " << unit.title());
+        unlink(manifest.values.c_str());
+        unlink(partition.file.c_str());
+        report.failed = true;
+    } else {
+        NCheckpoint::remove_replaced(index.manifest, manifest);
+    }
+
+    return report;
+}
+
+// commits a checkpoint with the namespace's log records, the values file
+// stays; replaying the logs over it afterwards changes nothing
+template<class TKey>
+bool fold(const Unit& unit)
+{
+    const auto index = load_index<TKey>(unit);
+    if (!index.log_records) {
+        return true;
+    }
+
+    auto manifest = NCheckpoint::write_partitions<TKey, uint64_t>(
+        unit.prefix(),
+        index.manifest.generation + 1,
+        index.offsets,
+        1,
+        {});
+    if (!manifest) {
+        return false;
+    }
+    manifest->values = index.manifest.values;
+
+    if (!NCheckpoint::commit_manifest(unit.prefix(), *manifest)) {
+        NCheckpoint::remove_replaced(*manifest, index.manifest);
+        return false;
+    }
+
+    NCheckpoint::remove_replaced(index.manifest, *manifest);
+    return true;
+}
+
+// after every namespace of the storage is folded: the sealed log goes
+// first, the current one alone still replays to the same index
+bool empty_logs(const std::string& storage)
+{
+    const auto paths = log_paths(storage);
+    if (unlink(paths[0].c_str()) != 0 && errno != ENOENT) {
+        return false;
+    }
+
+    sync_directory();
+    return write_temp(paths[1], "") && commit_temp(paths[1]);
+}
+
+// records of namespaces without files and a torn tail are reported
+template<class TKey>
+bool check_log(
+    const std::string& storage,
+    const std::string& path,
+    const std::vector<Unit>& units)
+{
+    const auto data = NCodec::read_file(path);
+
+    uint64_t unknown = 0;
+    const auto consumed = read_log<TKey>(
+        data,
+        [&] (const std::string& name, const TKey&, uint64_t) {
+            const auto known = std::any_of(
+                units.begin(),
+                units.end(),
+                [&] (const Unit& unit) {
+                    return unit.storage == storage && unit.name == name;
+                });
+            unknown += !known;
+        });
+
+    if (consumed != data.size()) {
+        LOG_WARN_S(path << ": " << data.size() - consumed << " torn bytes");
+    }
+
+    if (unknown) {
+        LOG_ERROR_S(path << ": " << unknown
+            << " records of namespaces without files");
+    }
+
+    return consumed == data.size() && !unknown;
+}
+
+// runs func(i) for i in [0, count) on up to threads threads
+void parallel_for(
+    int threads,
+    size_t count,
+    const std::function<void(size_t)>& func)
+{
+    std::atomic<size_t> next = 0;
+    std::vector<std::thread> workers;
+    for (int i = 0; i < threads && size_t(i) < count; ++i) {
+        workers.emplace_back([&] () {
+            for (auto j = next++; j < count; j = next++) {
+                func(j);
+            }
+        });
+    }
+
+    for (auto& worker: workers) {
+        worker.join();
+    }
+}
+
+void print(const Report& report)
+{
+    const double fragmentation = report.file_bytes
+        ? 100.0 * (report.file_bytes - report.live_bytes) / report.file_bytes
+        : 0;
+
+    LOG_INFO_S(report.unit.title()
+        << ": keys " << report.keys
+        << ", live bytes " << report.live_bytes
+        << ", file bytes " << report.file_bytes
+        << ", fragmentation " << std::fixed << std::setprecision(1)
+        << fragmentation << "%"
+        << ", log records " << report.log_records
+        << ", torn checkpoint bytes " << report.torn_bytes
+        << ", broken keys " << report.broken);
+}
+
+// moves the log records of every namespace into its checkpoint and then
+// empties the logs, a crash at any point leaves a directory that recovers
+template<class TKey>
+bool fold_logs(const ToolEnv& env, const std::vector<Unit>& units)
+{
+    std::atomic<bool> folded = true;
+    parallel_for(env.threads, units.size(), [&] (size_t i) {
+        if (!fold<TKey>(units[i])) {
+            folded = false;
+        }
+    });
+
+    for (const auto& storage: storages_of(units)) {
+        if (!folded || !empty_logs(storage)) {
+            LOG_ERROR_S("failed to move the log records of storage '"
+                << storage << "' into checkpoints");
+            return false;
+        }
+    }
+    sync_directory();
+
+    return true;
+}
+
+template<class TKey>
+int run(const ToolEnv& env, ECommand command)
+{
+    const auto units = discover();
+    const auto storages = storages_of(units);
+
+    bool ok = true;
+    for (const auto& storage: storages) {
+        for (const auto& path: log_paths(storage)) {
+            ok &= check_log<TKey>(storage, path, units);
+        }
+    }
+
+    // the logs would be emptied along with records no checkpoint has
+    if (command == ECommand::COMPACT && !ok) {
+        LOG_ERROR_S("not compacting a data directory with a damaged log");
+        return 1;
+    }
+
+    // a compacted values file must not meet log records pointing into the
+    // old one
+    if (command == ECommand::COMPACT && !fold_logs<TKey>(env, units)) {
+        LOG_ERROR_S("not compacting");
+        return 1;
+    }
+
+    std::vector<Report> reports(units.size());
+    parallel_for(env.threads, units.size(), [&] (size_t i) {
+        reports[i] = process<TKey>(units[i], command);
+    });
+
+    for (const auto& report: reports) {
+        print(report);
+        ok &= !report.failed && !report.broken && !report.torn_bytes;
+    }
+
+    return command == ECommand::STATS || ok ? 0 : 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// rewrites a checkpoint partition at from with TTo keys into the temp file
+// of to, false if a key does not fit TTo
+template<class TFrom, class TTo>
+bool convert_file(const std::string& from, const std::string& to)
+{
+    const auto data = NCodec::read_file(from);
+
+    std::string out;
+    bool ok = true;
+    NCodec::read_records<TFrom, uint64_t>(
+        data,
+        [&] (const TFrom& key, uint64_t offset) {
+            auto converted = key_of<TTo>(NCodec::key_bytes(key));
+            if (!converted) {
+                ok = false;
+                return;
+            }
+            NCodec::append_record(out, *converted, offset);
+        });
+
+    if (!ok) {
+        LOG_ERROR_S(from << ": keys that are not "
+            << fixed_key_size << " bytes long");
+        return false;
+    }
+
+    return write_temp(to, out);
+}
+
+// manifest of a conversion written next to the current one, renamed over
+// it by finish_convert()
+std::string staged_manifest_path(const std::string& prefix)
+{
+    return NCheckpoint::manifest_path(prefix) + ".convert";
+}
+
+// NCheckpoint::convert_journal: the prefixes whose staged manifests are to
+// be put in place, then the files of the checkpoints they replace
+struct ConvertJournal
+{
+    std::vector<std::string> prefixes;
+    std::vector<std::string> obsolete;
+};
+
+void write_strings(std::string& out, const std::vector<std::string>& strings)
+{
+    NCodec::Codec<uint32_t>::write(out, strings.size());
+    for (const auto& s: strings) {
+        NCodec::Codec<std::string>::write(out, s);
+    }
+}
+
+bool read_strings(std::string_view& in, std::vector<std::string>& strings)
+{
+    uint32_t count = 0;
+    if (!NCodec::Codec<uint32_t>::read(in, count)) {
+        return false;
+    }
+
+    strings.resize(count);
+    for (auto& s: strings) {
+        if (!NCodec::Codec<std::string>::read(in, s)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool conversion_pending()
+{
+    return access(NCheckpoint::convert_journal, F_OK) == 0;
+}
+
+// completes a committed conversion, also one interrupted by a crash: every
+// staged manifest is renamed into place (one already renamed is gone), then
+// the replaced checkpoints and the journal are removed
+bool finish_convert()
+{
+    if (!conversion_pending()) {
+        return true;
+    }
+
+    const auto data = NCodec::read_file(NCheckpoint::convert_journal);
+    std::string_view in = data;
+    ConvertJournal journal;
+    if (!read_strings(in, journal.prefixes)
+            || !read_strings(in, journal.obsolete))
+    {
+        LOG_ERROR_S(NCheckpoint::convert_journal << " is damaged");
+        return false;
+    }
+
+    for (const auto& prefix: journal.prefixes) {
+        const auto staged = staged_manifest_path(prefix);
+        const auto path = NCheckpoint::manifest_path(prefix);
+        if (rename(staged.c_str(), path.c_str()) != 0 && errno != ENOENT) {
+            LOG_ERROR_S("failed to put " << staged << " in place");
+            return false;
+        }
+    }
+    sync_directory();
+
+    for (const auto& file: journal.obsolete) {
+        unlink(file.c_str());
+    }
+
+    if (unlink(NCheckpoint::convert_journal) != 0) {
+        return false;
+    }
+    sync_directory();
+
+    LOG_INFO_S("put the converted checkpoints of "
+        << journal.prefixes.size() << " namespaces in place");
+    return true;
+}
+
+// KEY_SIZE mode switch, only the keys of the checkpoints and the logs
+// change: the log records are folded into the checkpoints first, so only
+// the checkpoints are converted, into partitions of the next generation
+// that no manifest names yet; their manifests are staged next to the
+// current ones, and committing the journal is the single switch: up to it
+// nothing the server reads has changed, after it finish_convert() (again
+// on the next kvtool run after a crash) puts all of them in place
+template<class TFrom, class TTo>
+int convert(const ToolEnv& env)
+{
+    const auto units = discover();
+
+    bool logs_ok = true;
+    for (const auto& storage: storages_of(units)) {
+        for (const auto& path: log_paths(storage)) {
+            logs_ok &= check_log<TFrom>(storage, path, units);
+        }
+    }
+    if (!logs_ok || !fold_logs<TFrom>(env, units)) {
+        LOG_ERROR_S("not converting");
+        return 1;
+    }
+
+    struct File
+    {
+        std::string from;
+        std::string to;
+    };
+
+    std::vector<File> files;
+    std::vector<NCheckpoint::Manifest> old_manifests;
+    std::vector<NCheckpoint::Manifest> manifests;
+    for (const auto& unit: units) {
+        auto manifest = NCheckpoint::read_manifest(unit.prefix());
+        auto converted = manifest;
+        ++converted.generation;
+        for (size_t k = 0; k < manifest.partitions.size(); ++k) {
+            auto& partition = converted.partitions[k];
+            partition.file = NCheckpoint::partition_path(
+                unit.prefix(),
+                converted.generation,
+                k);
+            files.push_back({manifest.partitions[k].file, partition.file});
+        }
+        old_manifests.push_back(std::move(manifest));
+        manifests.push_back(std::move(converted));
+    }
+
+    std::atomic<bool> ok = true;
+    parallel_for(env.threads, files.size(), [&] (size_t i) {
+        const auto& file = files[i];
+        if (!convert_file<TFrom, TTo>(file.from, file.to)) {
+            ok = false;
+        }
+    });
+
+    for (const auto& file: files) {
+        if (!ok || !commit_temp(file.to)) {
+            unlink((file.to + ".tmp").c_str());
+            ok = false;
+        }
+    }
+
+    ConvertJournal journal;
+    for (size_t i = 0; ok && i < units.size(); ++i) {
+        for (auto& partition: manifests[i].partitions) {
+            struct stat st;
+            partition.bytes = stat(partition.file.c_str(), &st) == 0
+                ? st.st_size
+                : 0;
+        }
+
+        const auto prefix = units[i].prefix();
+        ok = NCheckpoint::write_manifest(
+            staged_manifest_path(prefix),
+            manifests[i]);
+
+        journal.prefixes.push_back(prefix);
+        for (const auto& partition: old_manifests[i].partitions) {
+            journal.obsolete.push_back(partition.file);
+        }
+    }
+
+    if (ok) {
+        sync_directory();
+
+        std::string data;
+        write_strings(data, journal.prefixes);
+        write_strings(data, journal.obsolete);
+        ok = write_temp(NCheckpoint::convert_journal, data)
+            && commit_temp(NCheckpoint::convert_journal);
+    }
+
+    if (!ok) {
+        // nothing names the converted files yet
+        LOG_ERROR_S("failed to convert the checkpoints, keeping them as"
+            " they are");
+        for (size_t i = 0; i < units.size(); ++i) {
+            unlink(staged_manifest_path(units[i].prefix()).c_str());
+            NCheckpoint::remove_replaced(manifests[i], old_manifests[i]);
+        }
+        unlink((std::string(NCheckpoint::convert_journal) + ".tmp").c_str());
+        return 1;
+    }
+    sync_directory();
+
+    if (!finish_convert()) {
+        LOG_ERROR_S("the conversion is committed, run kvtool again to"
+            " finish it");
+        return 1;
+    }
+
+    LOG_INFO_S("converted " << files.size() << " files");
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// output files of a restore: values are appended in large writes and the
+// checkpoint (one partition) is written as the index is built, no log
+struct RestoreTarget
+{
+    Unit unit;
+    NCheckpoint::Manifest manifest;
+    int values_fd = -1;
+    int db_fd = -1;
+    std::string values;
+    std::string checkpoint;
+    uint64_t offset = 0;
+    bool failed = false;
+
+    void write(bool last)
+    {
+        if (values.size() >= io_chunk || last) {
+            failed |= !NCodec::write_all(values_fd, values);
+            values.clear();
+        }
+        if (checkpoint.size() >= io_chunk || last) {
+            failed |= !NCodec::write_all(db_fd, checkpoint);
+            manifest.partitions[0].bytes += checkpoint.size();
+            checkpoint.clear();
+        }
+    }
+};
+
+// bulk-loads a backup (snapshot.h) into a namespace without files, keys
+// are distributed among SHARDS shards like a shared-nothing server does
+template<class TKey>
+int restore(
+    const ToolEnv& env,
+    const std::string& path,
+    const std::string& name)
+{
+    std::vector<RestoreTarget> targets(std::max(env.shards, 1));
+    for (int i = 0; i < env.shards; ++i) {
+        targets[i].unit.storage = "shard" + std::to_string(i) + ".";
+    }
+
+    for (auto& target: targets) {
+        target.unit.name = name;
+
+        struct stat st;
+        bool logged = false;
+        for (const auto& log_path: target.unit.wal_paths()) {
+            read_log<TKey>(
+                NCodec::read_file(log_path),
+                [&] (const std::string& record_name, const TKey&, uint64_t) {
+                    logged |= record_name == name;
+                });
+        }
+        const auto manifest = NCheckpoint::read_manifest(target.unit.prefix());
+        if (logged
+                || stat(manifest.values.c_str(), &st) == 0
+                || !manifest.partitions.empty())
+        {
+            LOG_ERROR_S(target.unit.title()
+                << ": the namespace has data already");
+            return 1;
+        }
+    }
+
+    const int in = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (in == -1) {
+        LOG_ERROR_S("failed to open " << path);
+        return 1;
+    }
+    posix_fadvise(in, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    const int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+    for (auto& target: targets) {
+        target.manifest.generation = 1;
+        target.manifest.values = target.unit.file("values.bin");
+        target.manifest.partitions.push_back({NCheckpoint::partition_path(
+            target.unit.prefix(),
+            target.manifest.generation,
+            0)});
+        target.values_fd = open(
+            (target.unit.file("values.bin") + ".tmp").c_str(),
+            flags,
+            0644);
+        target.db_fd = open(
+            target.manifest.partitions[0].file.c_str(),
+            flags,
+            0644);
+        VERIFY(target.values_fd != -1 && target.db_fd != -1,
+            "failed to open output files");
+    }
+
+    uint64_t bad_keys = 0;
+    auto load = [&] (const std::string& key, const std::string& value) {
+        auto index_key = key_of<TKey>(key);
+        if (!index_key) {
+            ++bad_keys;
+            return;
+        }
+
+        auto& target = targets[
+            env.shards ? std::hash<std::string>()(key) % env.shards : 0];
+        NCodec::Codec<uint64_t>::write(target.values, value.size());
+        target.values.append(value);
+        NCodec::append_record(target.checkpoint, *index_key, target.offset);
+        ++target.manifest.partitions[0].records;
+        target.offset += sizeof(uint64_t) + value.size();
+        target.write(false);
+    };
+
+    NSnapshot::Reader reader;
+    std::string chunk(io_chunk, 0);
+    bool ok = true;
+    while (ok) {
+        const auto n = read(in, chunk.data(), chunk.size());
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            ok = n == 0;
+            break;
+        }
+        ok = reader.feed(std::string_view(chunk.data(), n), load);
+    }
+    close(in);
+
+    ok = ok && reader.complete() && !bad_keys;
+    for (auto& target: targets) {
+        target.write(true);
+        ok &= !target.failed;
+        ok &= sync_close(target.values_fd);
+        ok &= sync_close(target.db_fd);
+    }
+
+    // the manifests go last, a namespace without one is empty
+    for (auto& target: targets) {
+        const auto values_path = target.unit.file("values.bin");
+        if (!ok || !commit_temp(values_path)) {
+            unlink((values_path + ".tmp").c_str());
+            ok = false;
+        }
+    }
+    sync_directory();
+
+    for (auto& target: targets) {
+        if (!ok || !NCheckpoint::commit_manifest(
+                target.unit.prefix(),
+                target.manifest))
+        {
+            unlink(target.manifest.partitions[0].file.c_str());
+            ok = false;
+        }
+    }
+
+    if (!ok) {
+        LOG_ERROR_S("failed to restore " << path
+            << (reader.complete() ? "" : ": incomplete backup")
+            << (bad_keys ? ": keys that do not fit KEY_SIZE" : ""));
+        return 1;
+    }
+
+    LOG_INFO_S("restored " << reader.records() << " records of namespace '"
+        << name << "' into " << targets.size() << " storages");
+    return 0;
+}
+
+}   // namespace
+
+////////////////////////////////////////////////////////////////////////////////
+
+// offline maintenance of a data directory (the current directory), the
+// server must not be running
+int main(int argc, const char** argv)
+{
+    if (argc < 2) {
+        LOG_ERROR_S("usage: kvtool stats | verify | compact"
+            " | restore <backup> [namespace] | convert <key size>"
+            " (verify checks that every key points at a whole record, the"
+            " values have no checksums and their bytes are not checked)");
+        return 1;
+    }
+
+    const ToolEnv env;
+    const std::string command = argv[1];
+
+    // a conversion committed before a crash is finished first, it must not
+    // run again with the KEY_SIZE of the old checkpoints
+    const bool interrupted = conversion_pending();
+    if (!finish_convert()) {
+        return 1;
+    }
+    if (interrupted && command == "convert") {
+        return 0;
+    }
+
+    ECommand parsed;
+    if (command == "stats") {
+        parsed = ECommand::STATS;
+    } else if (command == "verify") {
+        parsed = ECommand::VERIFY;
+    } else if (command == "compact") {
+        parsed = ECommand::COMPACT;
+    } else if (command == "restore" && argc >= 3) {
+        const std::string name = argc >= 4 ? argv[3] : "";
+        if (env.key_size) {
+            return ::restore<NCodec::Key16>(env, argv[2], name);
+        }
+        return ::restore<std::string>(env, argv[2], name);
+    } else if (command == "convert" && argc >= 3) {
+        const auto to_key_size = strtoull(argv[2], nullptr, 10);
+        if (env.key_size == 0 && to_key_size == fixed_key_size) {
+            return ::convert<std::string, NCodec::Key16>(env);
+        }
+        if (env.key_size == fixed_key_size && to_key_size == 0) {
+            return ::convert<NCodec::Key16, std::string>(env);
+        }
+        LOG_ERROR_S("convert: KEY_SIZE=0 to 16 or KEY_SIZE=16 to 0");
+        return 1;
+    } else {
+        LOG_ERROR_S("unknown command " << command);
+        return 1;
+    }
+
+    if (env.key_size) {
+        return ::run<NCodec::Key16>(env, parsed);
+    }
+
+    return ::run<std::string>(env, parsed);
+}
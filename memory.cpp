@@ -0,0 +1,59 @@
+#include "memory.h"
+
+#include <atomic>
+
+namespace NMemory {
+
+namespace {
+
+////////////////////////////////////////////////////////////////////////////////
+
+std::atomic<int64_t> total{0};
+
+std::atomic<int64_t> soft_limit{0};
+std::atomic<int64_t> hard_limit{0};
+
+}   // namespace
+
+////////////////////////////////////////////////////////////////////////////////
+
+Account::Account(const std::string& name)
+    : Bytes(NStats::counter("memory." + name))
+{
+}
+
+void Account::add(int64_t bytes)
+{
+    Bytes.add(bytes);
+    total.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+int64_t total_bytes()
+{
+    return total.load(std::memory_order_relaxed);
+}
+
+void set_limits(int64_t soft, int64_t hard)
+{
+    soft_limit.store(soft, std::memory_order_relaxed);
+    hard_limit.store(hard, std::memory_order_relaxed);
+}
+
+EPressure pressure()
+{
+    const auto bytes = total_bytes();
+
+    const auto hard = hard_limit.load(std::memory_order_relaxed);
+    if (hard && bytes >= hard) {
+        return EPressure::HARD;
+    }
+
+    const auto soft = soft_limit.load(std::memory_order_relaxed);
+    if (soft && bytes >= soft) {
+        return EPressure::SOFT;
+    }
+
+    return EPressure::NONE;
+}
+
+}   // namespace NMemory
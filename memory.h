@@ -0,0 +1,103 @@
+#pragma once
+
+#include "stats.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <string>
+
+namespace NMemory {
+
+////////////////////////////////////////////////////////////////////////////////
+
+// tracked bytes of one subsystem, exported as the "memory.<name>" stat;
+// accounts of the same name share the bytes, e.g. a namespace's index in
+// every shard
+class Account
+{
+private:
+    NStats::Counter& Bytes;
+
+public:
+    explicit Account(const std::string& name);
+
+    // thread-safe, negative to release
+    void add(int64_t bytes);
+
+    int64_t bytes() const
+    {
+        return Bytes.get();
+    }
+};
+
+// sum of all accounts
+int64_t total_bytes();
+
+enum class EPressure
+{
+    NONE,
+    // over the soft limit: release what can be released
+    SOFT,
+    // over the hard limit: stop taking new requests as well
+    HARD,
+};
+
+// bytes, 0 disables a limit
+void set_limits(int64_t soft, int64_t hard);
+
+EPressure pressure();
+
+////////////////////////////////////////////////////////////////////////////////
+
+// std allocator charging everything it allocates to an account, for the
+// containers whose size is driven by the data (indexes, logs)
+template <typename T>
+class CountingAllocator
+{
+private:
+    template <typename U>
+    friend class CountingAllocator;
+
+    Account* Owner = nullptr;
+
+public:
+    using value_type = T;
+
+    explicit CountingAllocator(Account* owner)
+        : Owner(owner)
+    {
+    }
+
+    template <typename U>
+    CountingAllocator(const CountingAllocator<U>& other)
+        : Owner(other.Owner)
+    {
+    }
+
+    T* allocate(size_t n)
+    {
+        Owner->add(n * sizeof(T));
+        return static_cast<T*>(::operator new(n * sizeof(T)));
+    }
+
+    void deallocate(T* ptr, size_t n)
+    {
+        Owner->add(-int64_t(n * sizeof(T)));
+        ::operator delete(ptr);
+    }
+
+    template <typename U>
+    bool operator==(const CountingAllocator<U>& other) const
+    {
+        return Owner == other.Owner;
+    }
+
+    template <typename U>
+    bool operator!=(const CountingAllocator<U>& other) const
+    {
+        return Owner != other.Owner;
+    }
+};
+
+}   // namespace NMemory
@@ -0,0 +1,167 @@
+#include "pool.h"
+
+#include "memory.h"
+
+#include <cstdlib>
+
+namespace NPool {
+
+namespace {
+
+////////////////////////////////////////////////////////////////////////////////
+
+constexpr uint32_t size_class_count = max_size_class + 1;
+
+// buffers cached by a thread before they go to the shared free lists
+constexpr size_t thread_cache_size = 64;
+
+struct SharedFreeLists
+{
+    std::mutex mutex[size_class_count];
+    std::vector<BufferHeader*> buffers[size_class_count];
+};
+
+SharedFreeLists& shared_free_lists()
+{
+    static auto* lists = new SharedFreeLists();
+    return *lists;
+}
+
+struct ThreadCache
+{
+    std::vector<BufferHeader*> buffers[size_class_count];
+
+    ~ThreadCache()
+    {
+        auto& shared = shared_free_lists();
+        for (uint32_t c = 0; c < size_class_count; ++c) {
+            std::lock_guard<std::mutex> guard(shared.mutex[c]);
+            for (auto* header: buffers[c]) {
+                shared.buffers[c].push_back(header);
+            }
+        }
+    }
+};
+
+thread_local ThreadCache thread_cache;
+
+// buffers handed out vs buffers kept in the free lists
+NMemory::Account& live_account()
+{
+    static auto* account = new NMemory::Account("buffers");
+    return *account;
+}
+
+NMemory::Account& cached_account()
+{
+    static auto* account = new NMemory::Account("buffers_cached");
+    return *account;
+}
+
+uint32_t size_class_of(size_t capacity)
+{
+    uint32_t c = min_size_class;
+    while ((size_t(1) << c) < capacity) {
+        ++c;
+    }
+
+    return c;
+}
+
+BufferHeader* allocate_raw(size_t capacity, uint32_t size_class)
+{
+    void* memory = malloc(sizeof(BufferHeader) + capacity);
+    auto* header = new (memory) BufferHeader();
+    header->size_class = size_class;
+    header->capacity = capacity;
+    return header;
+}
+
+}   // namespace
+
+////////////////////////////////////////////////////////////////////////////////
+
+BufferHeader* acquire_buffer(size_t capacity)
+{
+    const auto c = size_class_of(capacity);
+    if (c > max_size_class) {
+        // oversized, size_class 0 marks it as not pooled
+        live_account().add(capacity);
+        return allocate_raw(capacity, 0);
+    }
+
+    BufferHeader* header = nullptr;
+
+    auto& cached = thread_cache.buffers[c];
+    if (!cached.empty()) {
+        header = cached.back();
+        cached.pop_back();
+    } else {
+        auto& shared = shared_free_lists();
+        std::lock_guard<std::mutex> guard(shared.mutex[c]);
+        if (!shared.buffers[c].empty()) {
+            header = shared.buffers[c].back();
+            shared.buffers[c].pop_back();
+        }
+    }
+
+    if (!header) {
+        live_account().add(size_t(1) << c);
+        return allocate_raw(size_t(1) << c, c);
+    }
+
+    cached_account().add(-int64_t(header->capacity));
+    live_account().add(header->capacity);
+
+    header->refs.store(1, std::memory_order_relaxed);
+    header->size = 0;
+    return header;
+}
+
+void release_buffer(BufferHeader* header)
+{
+    live_account().add(-int64_t(header->capacity));
+
+    const auto c = header->size_class;
+    if (c == 0) {
+        header->~BufferHeader();
+        free(header);
+        return;
+    }
+
+    cached_account().add(header->capacity);
+
+    auto& cached = thread_cache.buffers[c];
+    if (cached.size() < thread_cache_size) {
+        cached.push_back(header);
+        return;
+    }
+
+    auto& shared = shared_free_lists();
+    std::lock_guard<std::mutex> guard(shared.mutex[c]);
+    shared.buffers[c].push_back(header);
+}
+
+void trim_free_lists()
+{
+    auto free_all = [] (std::vector<BufferHeader*>& buffers) {
+        for (auto* header: buffers) {
+            cached_account().add(-int64_t(header->capacity));
+            header->~BufferHeader();
+            free(header);
+        }
+        buffers.clear();
+    };
+
+    for (uint32_t c = 0; c < size_class_count; ++c) {
+        free_all(thread_cache.buffers[c]);
+    }
+
+    auto& shared = shared_free_lists();
+    for (uint32_t c = 0; c < size_class_count; ++c) {
+        std::lock_guard<std::mutex> guard(shared.mutex[c]);
+        free_all(shared.buffers[c]);
+    }
+}
+
+}   // namespace NPool
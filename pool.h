@@ -0,0 +1,274 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace NPool {
+
+////////////////////////////////////////////////////////////////////////////////
+
+// buffers up to 2^max_size_class bytes are recycled, larger ones are freed
+constexpr uint32_t min_size_class = 6;
+constexpr uint32_t max_size_class = 22;
+
+struct BufferHeader
+{
+    std::atomic<uint32_t> refs{1};
+    uint32_t size_class = 0;
+    size_t capacity = 0;
+    size_t size = 0;
+
+    char* data()
+    {
+        return reinterpret_cast<char*>(this + 1);
+    }
+};
+
+BufferHeader* acquire_buffer(size_t capacity);
+void release_buffer(BufferHeader* header);
+
+// frees the cached buffers of the calling thread and the shared ones, the
+// other threads' caches are left alone
+void trim_free_lists();
+
+////////////////////////////////////////////////////////////////////////////////
+
+// reference-counted handle to a pooled byte buffer, copies share the bytes,
+// the buffer returns to its size class when the last handle goes away
+class BufferRef
+{
+private:
+    // a slice covers [Offset, Offset + Length) of the buffer, a whole
+    // buffer follows its header's size
+    static constexpr size_t whole = SIZE_MAX;
+
+    BufferHeader* Header = nullptr;
+    size_t Offset = 0;
+    size_t Length = whole;
+
+public:
+    BufferRef() = default;
+
+    explicit BufferRef(size_t capacity)
+        : Header(acquire_buffer(capacity))
+    {
+    }
+
+    BufferRef(const BufferRef& other)
+        : Header(other.Header)
+        , Offset(other.Offset)
+        , Length(other.Length)
+    {
+        if (Header) {
+            Header->refs.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    BufferRef(BufferRef&& other) noexcept
+        : Header(std::exchange(other.Header, nullptr))
+        , Offset(std::exchange(other.Offset, 0))
+        , Length(std::exchange(other.Length, whole))
+    {
+    }
+
+    BufferRef& operator=(BufferRef other) noexcept
+    {
+        std::swap(Header, other.Header);
+        std::swap(Offset, other.Offset);
+        std::swap(Length, other.Length);
+        return *this;
+    }
+
+    ~BufferRef()
+    {
+        reset();
+    }
+
+    void reset()
+    {
+        if (Header && Header->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            release_buffer(Header);
+        }
+        Header = nullptr;
+        Offset = 0;
+        Length = whole;
+    }
+
+    explicit operator bool() const
+    {
+        return Header != nullptr;
+    }
+
+    char* data() const
+    {
+        return Header ? Header->data() + Offset : nullptr;
+    }
+
+    size_t size() const
+    {
+        if (!Header) {
+            return 0;
+        }
+        return Length == whole ? Header->size : Length;
+    }
+
+    size_t capacity() const
+    {
+        if (!Header) {
+            return 0;
+        }
+        return Length == whole ? Header->capacity : Length;
+    }
+
+    bool empty() const
+    {
+        return size() == 0;
+    }
+
+    // no other handle (or slice) shares the bytes
+    bool unique() const
+    {
+        return Header && Header->refs.load(std::memory_order_acquire) == 1;
+    }
+
+    // within capacity only, buffers never reallocate; whole buffers only
+    void resize(size_t size)
+    {
+        Header->size = size;
+    }
+
+    // whole buffers only
+    void append(const char* buf, size_t size)
+    {
+        memcpy(data() + Header->size, buf, size);
+        Header->size += size;
+    }
+
+    std::string_view view() const
+    {
+        return {data(), size()};
+    }
+
+    // read-only handle to size bytes at offset, keeps the whole buffer alive
+    BufferRef slice(size_t offset, size_t size) const
+    {
+        BufferRef slice(*this);
+        slice.Offset += offset;
+        slice.Length = size;
+        return slice;
+    }
+
+    static BufferRef copy_of(std::string_view bytes)
+    {
+        BufferRef buffer(bytes.size());
+        buffer.append(bytes.data(), bytes.size());
+        return buffer;
+    }
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+// fixed-size object pool, objects are carved out of slabs and recycled
+// through a free list, slabs are never returned to the system
+template <size_t ObjectSize>
+class SlabPool
+{
+private:
+    static constexpr size_t objects_per_slab = 64;
+
+    union Node
+    {
+        Node* next;
+        alignas(std::max_align_t) char object[ObjectSize];
+    };
+
+    std::mutex Mutex;
+    Node* Free = nullptr;
+    std::vector<Node*> Slabs;
+
+public:
+    static SlabPool& instance()
+    {
+        static auto* pool = new SlabPool();
+        return *pool;
+    }
+
+    void* allocate()
+    {
+        std::lock_guard<std::mutex> guard(Mutex);
+        if (!Free) {
+            auto* slab = new Node[objects_per_slab];
+            Slabs.push_back(slab);
+            for (size_t i = 0; i < objects_per_slab; ++i) {
+                slab[i].next = Free;
+                Free = &slab[i];
+            }
+        }
+
+        auto* node = Free;
+        Free = node->next;
+        return node;
+    }
+
+    void deallocate(void* ptr)
+    {
+        auto* node = static_cast<Node*>(ptr);
+        std::lock_guard<std::mutex> guard(Mutex);
+        node->next = Free;
+        Free = node;
+    }
+};
+
+// allocator for std::allocate_shared, the object and its control block
+// come from one slab slot
+template <typename T>
+struct SlabAllocator
+{
+    using value_type = T;
+
+    SlabAllocator() = default;
+
+    template <typename U>
+    SlabAllocator(const SlabAllocator<U>&)
+    {
+    }
+
+    T* allocate(size_t n)
+    {
+        if (n != 1) {
+            return static_cast<T*>(::operator new(n * sizeof(T)));
+        }
+        return static_cast<T*>(SlabPool<sizeof(T)>::instance().allocate());
+    }
+
+    void deallocate(T* ptr, size_t n)
+    {
+        if (n != 1) {
+            ::operator delete(ptr);
+            return;
+        }
+        SlabPool<sizeof(T)>::instance().deallocate(ptr);
+    }
+
+    template <typename U>
+    bool operator==(const SlabAllocator<U>&) const
+    {
+        return true;
+    }
+
+    template <typename U>
+    bool operator!=(const SlabAllocator<U>&) const
+    {
+        return false;
+    }
+};
+
+}   // namespace NPool
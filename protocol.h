@@ -1,10 +1,12 @@
 #pragma once
 
 #include "log.h"
+#include "pool.h"
 
 #include <cstring>
 #include <ostream>
 #include <string>
+#include <string_view>
 
 namespace NProtocol {
 
@@ -15,12 +17,56 @@ constexpr char PUT_RESPONSE = 2U;
 constexpr char GET_REQUEST = 3U;
 constexpr char GET_RESPONSE = 4U;
 
+/*
+ * v2: raw binary payloads without protobuf, integers in host byte order
+ * like the frame length
+ * PUT_REQUEST_V2:  request_id (8) key_len (4) key value
+ * PUT_RESPONSE_V2: request_id (8)
+ * GET_REQUEST_V2:  request_id (8) key
+ * GET_RESPONSE_V2: request_id (8) value
+ */
+
+constexpr char PUT_REQUEST_V2 = 5U;
+constexpr char PUT_RESPONSE_V2 = 6U;
+constexpr char GET_REQUEST_V2 = 7U;
+constexpr char GET_RESPONSE_V2 = 8U;
+
+constexpr char STATS_REQUEST = 9U;
+constexpr char STATS_RESPONSE = 10U;
+
+/*
+ * v2 requests with a fixed-size binary key (KEY_SIZE=16 servers), answered
+ * with PUT_RESPONSE_V2 / GET_RESPONSE_V2
+ * PUT_REQUEST_K16: request_id (8) key (16) value
+ * GET_REQUEST_K16: request_id (8) key (16)
+ */
+
+constexpr char PUT_REQUEST_K16 = 11U;
+constexpr char GET_REQUEST_K16 = 12U;
+
+constexpr size_t fixed_key_size = 16;
+
+// TBackupRequest / TBackupResponse, a backup streamed to the client is
+// answered with a series of responses, the one with last set ends it
+constexpr char BACKUP_REQUEST = 13U;
+constexpr char BACKUP_RESPONSE = 14U;
+
+// TIngestRequest / TIngestResponse, every request is answered, the last one
+// of a stream once its dataset is visible
+constexpr char INGEST_REQUEST = 15U;
+constexpr char INGEST_RESPONSE = 16U;
+
+// request priority hints, low priority requests are served when the server
+// has nothing else to do (v2 requests are always PRIORITY_NORMAL)
+constexpr uint32_t PRIORITY_NORMAL = 0;
+constexpr uint32_t PRIORITY_LOW = 1;
+
 struct Message
 {
     char message_type = 0;
     uint32_t len = 0;
     uint32_t len_bytes = 0;
-    std::string buffer;
+    NPool::BufferRef buffer;
 
     size_t to_read() const
     {
@@ -35,29 +81,13 @@ struct Message
         return len - buffer.size();
     }
 
-    void on_data(char* buf, size_t size)
+    // the header has been read, the payload is received into buffer
+    void start(char type, uint32_t payload_len)
     {
-        if (!message_type) {
-            VERIFY(size == 1, "unexpected message_type size");
-
-            message_type = buf[0];
-        } else if (len_bytes < 4) {
-            VERIFY(size <= 4 - len_bytes, "unexpected len size");
-
-            // XXX not portable
-            memcpy(reinterpret_cast<char*>(&len) + len_bytes, buf, size);
-            len_bytes += size;
-
-            if (len_bytes == 4) {
-                buffer.reserve(len);
-            }
-        } else {
-            VERIFY(size <= len - buffer.size(), "unexpected len size");
-
-            auto old_size = buffer.size();
-            buffer.resize(old_size + size);
-            memcpy(const_cast<char*>(buffer.data()) + old_size, buf, size);
-        }
+        message_type = type;
+        len = payload_len;
+        len_bytes = 4;
+        buffer = NPool::BufferRef(len);
     }
 
     bool is_complete() const
@@ -70,16 +100,210 @@ struct Message
         message_type = 0;
         len_bytes = 0;
         len = 0;
-        buffer.clear();
+        // the handler may still hold the buffer, it is recycled when released
+        buffer.reset();
     }
 };
 
 ////////////////////////////////////////////////////////////////////////////////
 
+constexpr size_t header_size = 5;
+
+inline bool is_known_message_type(char message_type)
+{
+    return message_type >= PUT_REQUEST && message_type <= INGEST_RESPONSE;
+}
+
+// what a client may send to the server
+inline bool is_request_type(char message_type)
+{
+    switch (message_type) {
+        case PUT_REQUEST:
+        case GET_REQUEST:
+        case PUT_REQUEST_V2:
+        case GET_REQUEST_V2:
+        case STATS_REQUEST:
+        case PUT_REQUEST_K16:
+        case GET_REQUEST_K16:
+        case BACKUP_REQUEST:
+        case INGEST_REQUEST:
+            return true;
+    }
+    return false;
+}
+
+// complete frame found by scan_frames, its payload starts at data + offset
+struct Frame
+{
+    char message_type = 0;
+    uint32_t offset = 0;
+    uint32_t len = 0;
+};
+
+constexpr int max_scanned_frames = 64;
+
+/*
+ * walks the complete frames at the start of [data, data + size) and records
+ * them without copying, stops at the first incomplete frame or after
+ * max_frames; consumed is set to the total size of the recorded frames
+ * returns the number of frames or -1 on a message type accepted rejects
+ */
+inline int scan_frames(
+    const char* data,
+    size_t size,
+    Frame* frames,
+    int max_frames,
+    size_t& consumed,
+    bool (*accepted)(char message_type) = is_known_message_type)
+{
+    size_t pos = 0;
+    int n = 0;
+    while (n < max_frames && size - pos >= header_size) {
+        const char message_type = data[pos];
+        uint32_t len;
+        memcpy(&len, data + pos + 1, sizeof(len));
+
+        if (!accepted(message_type)) {
+            return -1;
+        }
+
+        if (size - pos - header_size < len) {
+            break;
+        }
+
+        frames[n++] = {message_type, uint32_t(pos + header_size), len};
+        pos += header_size + len;
+    }
+
+    consumed = pos;
+    return n;
+}
+
 inline void serialize_header(char message_type, uint32_t len, std::ostream& out)
 {
     out.write(&message_type, 1);
     out.write(reinterpret_cast<const char*>(&len), 4);
 }
 
+inline void serialize_header(char message_type, uint32_t len, char* out)
+{
+    out[0] = message_type;
+    memcpy(out + 1, &len, 4);
+}
+
+// header + protobuf message serialized straight into a pooled buffer
+template <typename TMessage>
+NPool::BufferRef serialize_message(char message_type, const TMessage& message)
+{
+    const auto len = message.ByteSizeLong();
+
+    NPool::BufferRef buffer(header_size + len);
+    serialize_header(message_type, len, buffer.data());
+    message.SerializeToArray(buffer.data() + header_size, len);
+    buffer.resize(header_size + len);
+
+    return buffer;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// any v2 message, key and value point into the frame buffer
+struct MessageV2
+{
+    uint64_t request_id = 0;
+    std::string_view key;
+    std::string_view value;
+};
+
+inline bool is_v2(char message_type)
+{
+    return message_type >= PUT_REQUEST_V2 && message_type <= GET_RESPONSE_V2;
+}
+
+inline bool parse_message_v2(
+    char message_type,
+    std::string_view payload,
+    MessageV2& message)
+{
+    if (payload.size() < 8) {
+        return false;
+    }
+
+    memcpy(&message.request_id, payload.data(), 8);
+    payload.remove_prefix(8);
+
+    switch (message_type) {
+        case PUT_REQUEST_V2: {
+            uint32_t key_len = 0;
+            if (payload.size() < 4) {
+                return false;
+            }
+
+            memcpy(&key_len, payload.data(), 4);
+            payload.remove_prefix(4);
+            if (payload.size() < key_len) {
+                return false;
+            }
+
+            message.key = payload.substr(0, key_len);
+            message.value = payload.substr(key_len);
+            return true;
+        }
+
+        case GET_REQUEST_V2:
+            message.key = payload;
+            return true;
+
+        case PUT_REQUEST_K16:
+        case GET_REQUEST_K16:
+            if (payload.size() < fixed_key_size
+                    || (message_type == GET_REQUEST_K16
+                        && payload.size() != fixed_key_size))
+            {
+                return false;
+            }
+
+            message.key = payload.substr(0, fixed_key_size);
+            message.value = payload.substr(fixed_key_size);
+            return true;
+
+        case PUT_RESPONSE_V2:
+            return payload.empty();
+
+        case GET_RESPONSE_V2:
+            message.value = payload;
+            return true;
+    }
+
+    return false;
+}
+
+// value_tail bytes of the value are not in the buffer, they are sent right
+// after it from elsewhere (a file)
+inline NPool::BufferRef serialize_message_v2(
+    char message_type,
+    const MessageV2& message,
+    size_t value_tail = 0)
+{
+    const bool with_key_len = message_type == PUT_REQUEST_V2;
+    const size_t len = 8
+        + (with_key_len ? 4 : 0)
+        + message.key.size()
+        + message.value.size();
+
+    NPool::BufferRef buffer(header_size + len);
+    serialize_header(message_type, len + value_tail, buffer.data());
+    buffer.resize(header_size);
+
+    buffer.append(reinterpret_cast<const char*>(&message.request_id), 8);
+    if (with_key_len) {
+        const uint32_t key_len = message.key.size();
+        buffer.append(reinterpret_cast<const char*>(&key_len), 4);
+    }
+    buffer.append(message.key.data(), message.key.size());
+    buffer.append(message.value.data(), message.value.size());
+
+    return buffer;
+}
+
 }   // namespace NProtocol
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+namespace NQueue {
+
+////////////////////////////////////////////////////////////////////////////////
+
+constexpr size_t cache_line_size = 64;
+
+// bounded lock-free single-producer single-consumer ring
+template <typename T>
+class SpscQueue
+{
+private:
+    std::vector<T> Slots;
+    const size_t Mask;
+
+    // written by the consumer only
+    alignas(cache_line_size) std::atomic<size_t> Head{0};
+    // written by the producer only
+    alignas(cache_line_size) std::atomic<size_t> Tail{0};
+
+public:
+    // capacity is rounded up to a power of two
+    explicit SpscQueue(size_t capacity)
+        : Slots(round_up(capacity))
+        , Mask(Slots.size() - 1)
+    {
+    }
+
+    // producer side, value is left untouched if the queue is full
+    bool try_push(T&& value)
+    {
+        const auto tail = Tail.load(std::memory_order_relaxed);
+        if (tail - Head.load(std::memory_order_acquire) == Slots.size()) {
+            return false;
+        }
+
+        Slots[tail & Mask] = std::move(value);
+        Tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // consumer side
+    bool try_pop(T& value)
+    {
+        const auto head = Head.load(std::memory_order_relaxed);
+        if (head == Tail.load(std::memory_order_acquire)) {
+            return false;
+        }
+
+        value = std::move(Slots[head & Mask]);
+        Head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    static size_t round_up(size_t capacity)
+    {
+        size_t size = 1;
+        while (size < capacity) {
+            size <<= 1;
+        }
+
+        return size;
+    }
+};
+
+}   // namespace NQueue
@@ -0,0 +1,672 @@
+#include "reactor.h"
+
+#include "log.h"
+
+#include <array>
+#include <chrono>
+#include <cstring>
+#include <string>
+#include <thread>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+static_assert(EAGAIN == EWOULDBLOCK);
+
+using namespace NLogging;
+using namespace NPool;
+using namespace NRpc;
+
+namespace NReactor {
+
+namespace {
+
+////////////////////////////////////////////////////////////////////////////////
+
+constexpr int max_events = 32;
+
+// deferred callbacks run per iteration when the loop is not saturated
+constexpr int max_deferred_per_iteration = 16;
+
+// how often a loop with stalled connections checks input_paused
+constexpr int stalled_poll_ms = 10;
+
+// how often accepting is retried while the process is out of file
+// descriptors: the acceptor's poll would report the pending connection
+// right away, a reactor's edge-triggered socket not again at all
+constexpr int accept_backoff_ms = 50;
+
+// set while accept fails for lack of file descriptors, the failure is
+// logged once until a connection is accepted again
+thread_local bool out_of_fds = false;
+
+////////////////////////////////////////////////////////////////////////////////
+
+int create_and_bind(std::string const& port, int cpu)
+{
+    struct addrinfo hints;
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = AF_UNSPEC; /* Return IPv4 and IPv6 choices */
+    hints.ai_socktype = SOCK_STREAM; /* TCP */
+    hints.ai_flags = AI_PASSIVE; /* All interfaces */
+
+    struct addrinfo* result;
+    int sockt = getaddrinfo(nullptr, port.c_str(), &hints, &result);
+    if (sockt != 0) {
+        LOG_ERROR("getaddrinfo failed");
+        return -1;
+    }
+
+    struct addrinfo* rp = nullptr;
+    int socketfd = 0;
+    for (rp = result; rp != nullptr; rp = rp->ai_next) {
+        socketfd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+        if (socketfd == -1) {
+            continue;
+        }
+
+        /*
+         * every reactor binds its own listening socket to the same port, the
+         * kernel prefers the one whose incoming cpu matches the cpu that
+         * handled the SYN (i.e. the NIC queue's cpu)
+         */
+        int one = 1;
+        if (setsockopt(socketfd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one))) {
+            LOG_ERROR("setsockopt failed (SO_REUSEPORT)");
+        }
+
+        if (cpu >= 0 && setsockopt(
+                socketfd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu)))
+        {
+            LOG_ERROR("setsockopt failed (SO_INCOMING_CPU)");
+        }
+
+        sockt = bind(socketfd, rp->ai_addr, rp->ai_addrlen);
+        if (sockt == 0) {
+            break;
+        }
+
+        close(socketfd);
+    }
+
+    if (rp == nullptr) {
+        LOG_ERROR("bind failed");
+        return -1;
+    }
+
+    freeaddrinfo(result);
+
+    return socketfd;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+bool make_socket_nonblocking(int socketfd)
+{
+    int flags = fcntl(socketfd, F_GETFL, 0);
+    if (flags == -1) {
+        LOG_ERROR("fcntl failed (F_GETFL)");
+        return false;
+    }
+
+    flags |= O_NONBLOCK;
+    int s = fcntl(socketfd, F_SETFL, flags);
+    if (s == -1) {
+        LOG_ERROR("fcntl failed (F_SETFL)");
+        return false;
+    }
+
+    return true;
+}
+
+// accept4 hands out the socket already non-blocking, the peer address is
+// not needed so there is no getnameinfo on the accept path either
+int accept_connection(int socketfd)
+{
+    while (true) {
+        int infd = accept4(
+            socketfd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (infd != -1) {
+            LOG_DEBUG_S("accepted connection on fd " << infd);
+            if (out_of_fds) {
+                LOG_INFO("accepting connections again");
+                out_of_fds = false;
+            }
+            return infd;
+        }
+
+        if (errno == EINTR || errno == ECONNABORTED) {
+            continue;
+        }
+
+        if (errno == EMFILE || errno == ENFILE) {
+            if (!out_of_fds) {
+                LOG_ERROR_S("accept4 failed: " << strerror(errno)
+                    << ", connections wait until descriptors are freed");
+                out_of_fds = true;
+            }
+        } else if (errno != EAGAIN) {
+            LOG_ERROR_S("accept4 failed: " << strerror(errno));
+        }
+
+        return -1;
+    }
+}
+
+int listen_on(const std::string& port, int cpu)
+{
+    auto socketfd = create_and_bind(port, cpu);
+    if (socketfd == -1) {
+        return -1;
+    }
+
+    if (!make_socket_nonblocking(socketfd)) {
+        close(socketfd);
+        return -1;
+    }
+
+    if (listen(socketfd, SOMAXCONN) == -1) {
+        LOG_ERROR("listen failed");
+        close(socketfd);
+        return -1;
+    }
+
+    return socketfd;
+}
+
+}   // namespace
+
+////////////////////////////////////////////////////////////////////////////////
+
+Reactor::Reactor(int index, int cpu)
+    : index(index)
+    , cpu(cpu)
+{
+    wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    VERIFY(wakefd != -1, "eventfd failed");
+}
+
+Reactor::~Reactor()
+{
+    close(wakefd);
+}
+
+void Reactor::wakeup()
+{
+    uint64_t one = 1;
+    if (write(wakefd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+        LOG_ERROR("eventfd write failed");
+    }
+}
+
+void Reactor::complete(const SocketStatePtr& state, Output response)
+{
+    if (state->fd == -1) {
+        // connection closed while the request was in flight
+        return;
+    }
+
+    completed.emplace_back(state, std::move(response));
+}
+
+void Reactor::schedule(std::function<void()> callback)
+{
+    {
+        std::lock_guard<std::mutex> guard(inbox_mutex);
+        inbox.push_back(std::move(callback));
+    }
+
+    wakeup();
+}
+
+void Reactor::defer(std::function<void()> callback)
+{
+    deferred.push_back(std::move(callback));
+}
+
+void Reactor::flush()
+{
+    ++flushes;
+
+    // responses completed after this point wait for the following flush
+    std::vector<std::pair<SocketStatePtr, Output>> responses;
+    responses.swap(completed);
+
+    if (on_flush) {
+        on_flush();
+    }
+
+    for (auto& [state, response]: responses) {
+        if (state->fd == -1) {
+            continue;
+        }
+
+        state->output_queue.push_back(std::move(response));
+        send_output(state);
+    }
+
+    // waiters may start new writes that wait for the following flush
+    std::vector<std::function<void()>> waiters;
+    waiters.swap(flush_waiters);
+    for (auto& waiter: waiters) {
+        waiter();
+    }
+}
+
+bool Reactor::is_zerocopy_completion(int fd)
+{
+    auto it = states.find(fd);
+    if (it == states.end() || it->second->zerocopy_pending.empty()) {
+        return false;
+    }
+
+    if (!process_zerocopy_completions(*it->second)) {
+        return false;
+    }
+
+    // the released buffers may be what a waiter is counting
+    notify_output(it->second);
+
+    // a real socket error is still pending behind the completions
+    int error = 0;
+    socklen_t len = sizeof(error);
+    getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len);
+    return error == 0;
+}
+
+bool Reactor::adopt(int fd)
+{
+    // EPOLLOUT is added by send_output once a send would block
+    struct epoll_event event;
+    event.data.fd = fd;
+    event.events = EPOLLIN | EPOLLET;
+    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &event) == -1) {
+        LOG_ERROR("epoll_ctl failed");
+        close(fd);
+        return false;
+    }
+
+    // connection objects are recycled through a slab, churn does not hit malloc
+    auto state = std::allocate_shared<SocketState>(SlabAllocator<SocketState>());
+    state->fd = fd;
+    state->accepted_types = NProtocol::is_request_type;
+
+    int one = 1;
+    if (zerocopy_threshold && setsockopt(
+            fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0)
+    {
+        state->zerocopy_threshold = zerocopy_threshold;
+    }
+
+    // values above net.core.busy_read need CAP_NET_ADMIN
+    if (busy_poll_us && setsockopt(
+            fd, SOL_SOCKET, SO_BUSY_POLL, &busy_poll_us, sizeof(busy_poll_us)))
+    {
+        LOG_DEBUG_S("setsockopt failed (SO_BUSY_POLL): " << strerror(errno));
+    }
+
+    states[fd] = std::move(state);
+    return true;
+}
+
+void Reactor::accept_all(int socketfd)
+{
+    // drain the backlog, the listening socket is edge-triggered
+    while (true) {
+        const auto infd = accept_connection(socketfd);
+        if (infd == -1) {
+            break;
+        }
+
+        adopt(infd);
+    }
+}
+
+int Reactor::wait(struct epoll_event* events, int max_events)
+{
+    // deferred work is waiting, only check for new events
+    int timeout = deferred.empty() ? timeout_ms : 0;
+    if (!stalled.empty() && (timeout < 0 || timeout > stalled_poll_ms)) {
+        timeout = stalled_poll_ms;
+    }
+    if (out_of_fds && (timeout < 0 || timeout > accept_backoff_ms)) {
+        timeout = accept_backoff_ms;
+    }
+
+    if (!spin_us || !timeout) {
+        return epoll_wait(epollfd, events, max_events, timeout);
+    }
+
+    const auto deadline = std::chrono::steady_clock::now()
+        + std::chrono::microseconds(spin_us);
+
+    do {
+        const auto n = epoll_wait(epollfd, events, max_events, 0);
+        if (n != 0) {
+            return n;
+        }
+    } while (std::chrono::steady_clock::now() < deadline);
+
+    return epoll_wait(epollfd, events, max_events, timeout);
+}
+
+void Reactor::send_output(const SocketStatePtr& state)
+{
+    if (!process_output(*state)) {
+        finalize(state->fd);
+        return;
+    }
+
+    notify_output(state);
+
+    const bool waiting = has_output(*state);
+    if (waiting == state->waiting_output) {
+        return;
+    }
+
+    struct epoll_event event;
+    event.data.fd = state->fd;
+    event.events = EPOLLIN | EPOLLET | (waiting ? uint32_t(EPOLLOUT) : 0u);
+    if (epoll_ctl(epollfd, EPOLL_CTL_MOD, state->fd, &event) == -1) {
+        LOG_ERROR("epoll_ctl failed");
+        finalize(state->fd);
+        return;
+    }
+
+    state->waiting_output = waiting;
+}
+
+void Reactor::notify_output(const SocketStatePtr& state)
+{
+    if (state->output_waiters.empty()) {
+        return;
+    }
+
+    // waiters may register again for the next send
+    std::vector<std::function<void()>> waiters;
+    waiters.swap(state->output_waiters);
+    for (auto& waiter: waiters) {
+        waiter();
+    }
+}
+
+void Reactor::finalize(int fd)
+{
+    LOG_DEBUG_S("close " << fd);
+
+    close(fd);
+
+    auto it = states.find(fd);
+    if (it != states.end()) {
+        auto state = std::move(it->second);
+        states.erase(it);
+        state->fd = -1;
+        notify_output(state);
+    }
+}
+
+int Reactor::run(const std::string& port, const Dispatch& dispatch)
+{
+    /*
+     * socket creation and epoll boilerplate
+     */
+
+    int socketfd = -1;
+    if (listening) {
+        socketfd = listen_on(port, cpu);
+        if (socketfd == -1) {
+            return 1;
+        }
+    }
+
+    epollfd = epoll_create1(0);
+    if (epollfd == -1) {
+        LOG_ERROR("epoll_create1 failed");
+        return 1;
+    }
+
+    struct epoll_event event;
+    event.data.fd = socketfd;
+    event.events = EPOLLIN | EPOLLET;
+    if (listening && epoll_ctl(epollfd, EPOLL_CTL_ADD, socketfd, &event) == -1) {
+        LOG_ERROR("epoll_ctl failed");
+        return 1;
+    }
+
+    event.data.fd = wakefd;
+    event.events = EPOLLIN | EPOLLET;
+    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, wakefd, &event) == -1) {
+        LOG_ERROR("epoll_ctl failed");
+        return 1;
+    }
+
+    /*
+     * event loop
+     */
+
+    std::array<struct epoll_event, max_events> events;
+
+    // connections whose input was processed in this iteration, their
+    // responses go out after a single flush of everything they wrote
+    std::vector<SocketStatePtr> processed;
+
+    auto read_input = [&] (const SocketStatePtr& state) {
+        if (input_paused && input_paused()) {
+            if (!state->input_stalled) {
+                state->input_stalled = true;
+                stalled.push_back(state);
+            }
+            return;
+        }
+
+        Handler handler = [&] (char type, const BufferRef& message) {
+            return dispatch(state, type, message);
+        };
+
+        if (!process_input(*state, handler)) {
+            finalize(state->fd);
+            return;
+        }
+
+        processed.push_back(state);
+    };
+
+    while (true) {
+        const auto n = wait(events.data(), max_events);
+        ++wakeups;
+
+        LOG_DEBUG_S("got " << n << " events");
+
+        for (int i = 0; i < n; ++i) {
+            const auto fd = events[i].data.fd;
+
+            if (fd == wakefd) {
+                uint64_t count;
+                while (read(wakefd, &count, sizeof(count)) > 0) {
+                }
+
+                std::vector<std::function<void()>> callbacks;
+                {
+                    std::lock_guard<std::mutex> guard(inbox_mutex);
+                    callbacks.swap(inbox);
+                }
+
+                for (auto& callback: callbacks) {
+                    callback();
+                }
+
+                if (on_wakeup) {
+                    on_wakeup();
+                }
+
+                continue;
+            }
+
+            if (events[i].events & EPOLLERR && is_zerocopy_completion(fd)) {
+                // MSG_ZEROCOPY completions are signalled through EPOLLERR
+                events[i].events &= ~EPOLLERR;
+                if (!(events[i].events & (EPOLLIN | EPOLLOUT))) {
+                    continue;
+                }
+            }
+
+            if (events[i].events & EPOLLERR
+                    || events[i].events & EPOLLHUP
+                    || !(events[i].events & (EPOLLIN | EPOLLOUT)))
+            {
+                LOG_ERROR_S("epoll event error on fd " << fd);
+
+                finalize(fd);
+
+                continue;
+            }
+
+            if (socketfd == fd) {
+                accept_all(socketfd);
+                continue;
+            }
+
+            auto it = states.find(fd);
+            if (it == states.end()) {
+                continue;
+            }
+
+            // keeps the state alive if the connection is closed meanwhile
+            auto state = it->second;
+
+            if (events[i].events & EPOLLIN) {
+                read_input(state);
+                if (!state->input_stalled) {
+                    continue;
+                }
+            }
+
+            // EPOLLOUT only (or stalled input), what is queued has been
+            // flushed already
+            send_output(state);
+        }
+
+        // the backlog left while out of descriptors raises no new event
+        if (out_of_fds && socketfd != -1) {
+            accept_all(socketfd);
+        }
+
+        if (!stalled.empty() && !(input_paused && input_paused())) {
+            auto resumed = std::move(stalled);
+            stalled.clear();
+            for (auto& state: resumed) {
+                state->input_stalled = false;
+                if (state->fd != -1) {
+                    read_input(state);
+                }
+            }
+        }
+
+        if (!processed.empty()) {
+            flush();
+
+            for (auto& state: processed) {
+                if (state->fd != -1) {
+                    send_output(state);
+                }
+            }
+            processed.clear();
+        }
+
+        int budget = n == max_events ? 1 : max_deferred_per_iteration;
+        while (budget-- > 0 && !deferred.empty()) {
+            auto callback = std::move(deferred.front());
+            deferred.pop_front();
+            callback();
+        }
+
+        while (!flush_waiters.empty() || !completed.empty()) {
+            flush();
+        }
+
+        if (on_iteration) {
+            on_iteration();
+        }
+    }
+
+    LOG_INFO("exiting");
+
+    if (socketfd != -1) {
+        close(socketfd);
+    }
+
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+int run_acceptor(const std::string& port, const std::vector<Reactor*>& reactors)
+{
+    auto socketfd = listen_on(port, -1);
+    if (socketfd == -1) {
+        return 1;
+    }
+
+    struct pollfd pfd;
+    pfd.fd = socketfd;
+    pfd.events = POLLIN;
+
+    size_t next = 0;
+    std::vector<std::vector<int>> batches(reactors.size());
+
+    while (true) {
+        if (poll(&pfd, 1, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            LOG_ERROR("poll failed");
+            break;
+        }
+
+        while (true) {
+            const auto infd = accept_connection(socketfd);
+            if (infd == -1) {
+                break;
+            }
+
+            batches[next].push_back(infd);
+            next = (next + 1) % reactors.size();
+        }
+
+        // one wakeup per reactor for the whole batch
+        for (size_t i = 0; i < reactors.size(); ++i) {
+            if (batches[i].empty()) {
+                continue;
+            }
+
+            auto* reactor = reactors[i];
+            reactor->schedule([reactor, fds = std::move(batches[i])] () {
+                for (const auto fd: fds) {
+                    reactor->adopt(fd);
+                }
+            });
+            batches[i].clear();
+        }
+
+        if (out_of_fds) {
+            std::this_thread::sleep_for(
+                std::chrono::milliseconds(accept_backoff_ms));
+        }
+    }
+
+    close(socketfd);
+
+    return 1;
+}
+
+}   // namespace NReactor
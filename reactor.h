@@ -0,0 +1,141 @@
+#pragma once
+
+#include "rpc.h"
+
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/epoll.h>
+
+namespace NReactor {
+
+////////////////////////////////////////////////////////////////////////////////
+
+// request -> response func with access to the connection, an empty response
+// means that the request will be answered later via Reactor::complete
+using Dispatch = std::function<NRpc::Output(
+    const NRpc::SocketStatePtr& state,
+    char message_type,
+    const NPool::BufferRef& message)>;
+
+////////////////////////////////////////////////////////////////////////////////
+
+// single-threaded epoll loop owning a listening socket and its connections
+struct Reactor
+{
+    int index = 0;
+    // cpu the reactor is pinned to, -1 if not pinned
+    int cpu = -1;
+    // eventfd used by other threads to interrupt epoll_wait
+    int wakefd = -1;
+
+    // false if connections are handed over by an acceptor thread instead
+    // of being accepted on the reactor's own listening socket
+    bool listening = true;
+
+    // epoll_wait timeout, on_iteration runs at least that often
+    int timeout_ms = -1;
+
+    // after an event the loop keeps polling epoll without blocking for this
+    // long before it goes to sleep, trades cpu for wakeup latency
+    int spin_us = 0;
+    // SO_BUSY_POLL for the connections, 0 leaves the socket default
+    int busy_poll_us = 0;
+
+    // responses of at least this many bytes are sent with MSG_ZEROCOPY,
+    // 0 disables zerocopy
+    size_t zerocopy_threshold = 0;
+
+    // called in the loop after wakeup() from any thread
+    std::function<void()> on_wakeup;
+    // called after a connection's input is processed and before its
+    // responses are sent, pending writes must become durable here
+    std::function<void()> on_flush;
+    // called after every epoll_wait
+    std::function<void()> on_iteration;
+    // backpressure: while it returns true the connections' input is left in
+    // the sockets, they are read once it returns false again
+    std::function<bool()> input_paused;
+
+    // loop state, touched by the reactor thread only
+    int epollfd = -1;
+    std::unordered_map<int, NRpc::SocketStatePtr> states;
+
+    // callbacks scheduled by other threads
+    std::mutex inbox_mutex;
+    std::vector<std::function<void()>> inbox;
+
+    // callbacks waiting for the next flush, reactor thread only
+    std::vector<std::function<void()>> flush_waiters;
+
+    // responses passed to complete, they are sent by the next flush so that
+    // nothing is acknowledged before the writes staged with it are durable
+    std::vector<std::pair<NRpc::SocketStatePtr, NRpc::Output>> completed;
+
+    // low-priority callbacks, reactor thread only: they run after the
+    // iteration's requests, only one per iteration while every epoll_wait
+    // returns a full batch of events
+    std::deque<std::function<void()>> deferred;
+
+    // connections with unread input while input_paused, reactor thread only
+    std::vector<NRpc::SocketStatePtr> stalled;
+
+    // loop statistics, reactor thread only
+    uint64_t wakeups = 0;
+    uint64_t flushes = 0;
+
+    Reactor(int index, int cpu);
+    ~Reactor();
+
+    // thread-safe
+    void wakeup();
+
+    // answers a request dispatched earlier, reactor thread only
+    void complete(const NRpc::SocketStatePtr& state, NRpc::Output response);
+
+    // thread-safe, runs callback in the loop
+    void schedule(std::function<void()> callback);
+
+    // reactor thread only, runs callback when there is no foreground work
+    void defer(std::function<void()> callback);
+
+    // runs on_flush, sends the completed responses and then runs everything
+    // waiting for it
+    void flush();
+
+    // binds to port and serves connections until a fatal error
+    int run(const std::string& port, const Dispatch& dispatch);
+
+    // takes over an accepted non-blocking socket, reactor thread only
+    bool adopt(int fd);
+
+    // accepts and adopts the listening socket's pending connections
+    void accept_all(int socketfd);
+
+    // sends what the socket accepts and keeps EPOLLOUT registered only while
+    // something is left, reactor thread only
+    void send_output(const NRpc::SocketStatePtr& state);
+
+    // runs and clears the connection's output waiters, reactor thread only
+    void notify_output(const NRpc::SocketStatePtr& state);
+
+    void finalize(int fd);
+
+    // epoll_wait honoring spin_us, reactor thread only
+    int wait(struct epoll_event* events, int max_events);
+
+    // drains the error queue, true if EPOLLERR only carried completions
+    bool is_zerocopy_completion(int fd);
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+// accepts connections on port and distributes them round-robin among the
+// reactors (which must not be listening themselves), runs until a fatal error
+int run_acceptor(const std::string& port, const std::vector<Reactor*>& reactors);
+
+}   // namespace NReactor
@@ -7,50 +7,158 @@
 #include <functional>
 #include <memory>
 #include <string>
+#include <utility>
+#include <vector>
 
+#include <netinet/in.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 
+#include <linux/errqueue.h>
+
 namespace NRpc {
 
 ////////////////////////////////////////////////////////////////////////////////
 
+// part of a file sent with sendfile, its bytes never enter user space
+struct FileRegion
+{
+    int fd = -1;
+    uint64_t offset = 0;
+    uint64_t size = 0;
+};
+
+// bytes queued for a socket: a buffer, optionally followed by a file region
+struct Output
+{
+    NPool::BufferRef buffer;
+    FileRegion file;
+
+    Output() = default;
+
+    Output(NPool::BufferRef buffer)
+        : buffer(std::move(buffer))
+    {
+    }
+
+    Output(NPool::BufferRef buffer, FileRegion file)
+        : buffer(std::move(buffer))
+        , file(file)
+    {
+    }
+
+    explicit operator bool() const
+    {
+        return bool(buffer);
+    }
+
+    uint64_t size() const
+    {
+        return buffer.size() + file.size;
+    }
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
 struct SocketState
 {
     int fd = 0;
 
+    // received bytes that do not form a complete frame yet
+    NPool::BufferRef input;
+    // frame too large for the receive buffer, read separately
     NProtocol::Message current_message;
 
-    std::deque<std::string> output_queue;
-
-    uint32_t current_output_sent_count = 0;
-    std::string current_output;
+    std::deque<Output> output_queue;
+
+    uint64_t current_output_sent_count = 0;
+    Output current_output;
+
+    // EPOLLOUT is registered only while a send would block
+    bool waiting_output = false;
+    // input left unread by the reactor's backpressure, see Reactor::stalled
+    bool input_stalled = false;
+
+    // message types the peer may send, another one closes the connection
+    bool (*accepted_types)(char message_type) =
+        NProtocol::is_known_message_type;
+    // set by a handler that refuses a request, the connection is closed
+    // instead of reading further
+    bool rejected = false;
+
+    // one-shot callbacks run by the reactor once the connection has sent
+    // something, released zerocopy buffers or closed, reactor thread only
+    std::vector<std::function<void()>> output_waiters;
+
+    // sends of at least this many bytes use MSG_ZEROCOPY, 0 disables it
+    size_t zerocopy_threshold = 0;
+    // number of the next zerocopy send, the kernel counts them the same way
+    uint32_t zerocopy_next = 0;
+    // buffers the kernel may still read from, keyed by their last send
+    std::deque<std::pair<uint32_t, NPool::BufferRef>> zerocopy_pending;
 };
 
 using SocketStatePtr = std::shared_ptr<SocketState>;
 
+inline bool has_output(const SocketState& state)
+{
+    return bool(state.current_output) || !state.output_queue.empty();
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
-// input -> output func
-using Handler =
-    std::function<std::string(char message_type, const std::string& message)>;
+// receive buffer size, pipelined frames are read with one recv
+constexpr size_t input_buffer_size = 64 * 1024;
+
+// input -> output func, an empty output means no response
+using Handler = std::function<Output(
+    char message_type,
+    const NPool::BufferRef& message)>;
 
 ////////////////////////////////////////////////////////////////////////////////
 
 inline bool process_input(SocketState& state, const Handler& handler)
 {
     bool success = true;
+    size_t total_read = 0;
+
+    auto dispatch = [&] (char message_type, const NPool::BufferRef& message) {
+        auto response = handler(message_type, message);
+        if (response) {
+            state.output_queue.push_back(std::move(response));
+        }
+        return !state.rejected;
+    };
+
+    NProtocol::Frame frames[NProtocol::max_scanned_frames];
 
-    char buf[512];
-    int total_read = 0;
     while (true) {
-        auto len = std::min(sizeof(buf), state.current_message.to_read());
-        auto count = recv(state.fd, buf, len, 0);
+        auto& message = state.current_message;
+        auto& input = state.input;
+
+        // a frame larger than the receive buffer is read straight into its
+        // own buffer, everything else is received in bulk and scanned
+        char* dst = nullptr;
+        size_t len = 0;
+        if (message.message_type) {
+            dst = message.buffer.data() + message.buffer.size();
+            len = message.to_read();
+        } else {
+            if (!input) {
+                input = NPool::BufferRef(input_buffer_size);
+            }
+
+            dst = input.data() + input.size();
+            len = input.capacity() - input.size();
+        }
+
+        auto count = recv(state.fd, dst, len, 0);
 
         if (count == -1) {
             if (errno != EAGAIN) {
                 // TODO proper logging
-                perror("send failed");
+                perror("recv failed");
 
                 success = false;
             }
@@ -60,23 +168,90 @@ inline bool process_input(SocketState& state, const Handler& handler)
             break;
         }
         total_read += count;
-        state.current_message.on_data(buf, count);
 
-        if (count < len) {
-            break;
-        }
-
-        if (state.current_message.is_complete()) {
-            auto response = handler(
-                state.current_message.message_type,
-                state.current_message.buffer);
+        if (message.message_type) {
+            message.buffer.resize(message.buffer.size() + count);
+            if (message.is_complete()) {
+                const bool ok = dispatch(message.message_type, message.buffer);
+                message.reset();
+                if (!ok) {
+                    return false;
+                }
+            }
+        } else {
+            input.resize(input.size() + count);
+
+            size_t pos = 0;
+            while (true) {
+                size_t consumed = 0;
+                const auto n = NProtocol::scan_frames(
+                    input.data() + pos,
+                    input.size() - pos,
+                    frames,
+                    NProtocol::max_scanned_frames,
+                    consumed,
+                    state.accepted_types);
+
+                if (n == -1) {
+                    LOG_ERROR("unexpected message type");
+                    return false;
+                }
+
+                // the frames are handed out as slices of the receive buffer,
+                // a request that keeps its frame keeps the buffer alive
+                for (int i = 0; i < n; ++i) {
+                    const bool ok = dispatch(
+                        frames[i].message_type,
+                        input.slice(pos + frames[i].offset, frames[i].len));
+                    if (!ok) {
+                        return false;
+                    }
+                }
+
+                pos += consumed;
+                if (n < NProtocol::max_scanned_frames) {
+                    break;
+                }
+            }
 
-            state.current_message.reset();
+            auto rest = input.size() - pos;
+            if (rest >= NProtocol::header_size) {
+                uint32_t frame_len;
+                memcpy(&frame_len, input.data() + pos + 1, sizeof(frame_len));
+
+                if (NProtocol::header_size + frame_len > input.capacity()) {
+                    message.start(input.data()[pos], frame_len);
+                    message.buffer.append(
+                        input.data() + pos + NProtocol::header_size,
+                        rest - NProtocol::header_size);
+                    rest = 0;
+                }
+            }
 
-            if (response.size()) {
-                state.output_queue.push_back(std::move(response));
+            if (input.unique()) {
+                // the incomplete frame moves to the front
+                memmove(input.data(), input.data() + input.size() - rest, rest);
+                input.resize(rest);
+            } else {
+                // requests still refer to the buffer, the incomplete frame
+                // goes to a new one
+                NPool::BufferRef next;
+                if (rest) {
+                    next = NPool::BufferRef(input_buffer_size);
+                    next.append(input.data() + input.size() - rest, rest);
+                }
+                input = std::move(next);
             }
         }
+
+        if (size_t(count) < len) {
+            break;
+        }
+    }
+
+    // idle connections do not hold on to a receive buffer
+    if (state.input && state.input.empty()) {
+        state.input.reset();
     }
 
     if (total_read == 0) {
@@ -94,26 +269,59 @@ inline bool process_output(SocketState& state)
     bool success = true;
 
     while (true) {
-        auto& buffer = state.current_output;
+        auto& output = state.current_output;
         auto& offset = state.current_output_sent_count;
 
-        if (state.current_output.empty()) {
+        if (!state.current_output) {
             if (state.output_queue.empty()) {
                 break;
             }
 
-            buffer = state.output_queue.front();
+            output = std::move(state.output_queue.front());
             offset = 0;
             state.output_queue.pop_front();
         }
 
-        auto len = buffer.size() - offset;
+        auto& buffer = output.buffer;
+
+        size_t len = 0;
+        ssize_t count = 0;
+
+        if (offset < buffer.size()) {
+            len = buffer.size() - offset;
+
+            const bool zerocopy = state.zerocopy_threshold
+                && len >= state.zerocopy_threshold;
+
+            count = send(
+                state.fd,
+                buffer.data() + offset,
+                len,
+                MSG_NOSIGNAL | (zerocopy ? MSG_ZEROCOPY : 0));
+
+            if (zerocopy) {
+                if (count == -1 && errno == ENOBUFS) {
+                    // out of optmem for pinned pages, fall back to a copy
+                    count = send(
+                        state.fd,
+                        buffer.data() + offset,
+                        len,
+                        MSG_NOSIGNAL);
+                } else if (count != -1) {
+                    // the kernel reads from the pages after send returns, the
+                    // reference is dropped once the completion arrives
+                    state.zerocopy_pending.emplace_back(
+                        state.zerocopy_next++,
+                        buffer);
+                }
+            }
+        } else {
+            const auto file_offset = offset - buffer.size();
+            len = output.file.size - file_offset;
 
-        const auto count = send(
-            state.fd,
-            buffer.data() + offset,
-            len,
-            MSG_NOSIGNAL);
+            off_t position = output.file.offset + file_offset;
+            count = sendfile(state.fd, output.file.fd, &position, len);
+        }
 
         if (count == -1) {
             if (errno != EAGAIN) {
@@ -128,14 +336,68 @@ inline bool process_output(SocketState& state)
             break;
         }
 
-        if (count == len) {
-            buffer.clear();
-        } else {
-            offset += count;
+        offset += count;
+        if (offset == output.size()) {
+            output = Output();
+            offset = 0;
         }
     }
 
     return success;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+
+// reads MSG_ZEROCOPY completions from the socket error queue and releases
+// the buffers the kernel is done with, false if the queue had nothing
+inline bool process_zerocopy_completions(SocketState& state)
+{
+    bool found = false;
+
+    while (true) {
+        char control[128];
+        struct msghdr msg = {};
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        if (recvmsg(state.fd, &msg, MSG_ERRQUEUE) == -1) {
+            break;
+        }
+
+        for (auto* cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            const bool recverr =
+                (cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR)
+                || (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR);
+            if (!recverr) {
+                continue;
+            }
+
+            const auto* err =
+                reinterpret_cast<const struct sock_extended_err*>(CMSG_DATA(cm));
+            if (err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                continue;
+            }
+
+            found = true;
+
+            // [ee_info, ee_data] is the range of completed sends
+            const uint32_t last = err->ee_data;
+            auto& pending = state.zerocopy_pending;
+            while (!pending.empty()
+                    && static_cast<int32_t>(pending.front().first - last) <= 0)
+            {
+                pending.pop_front();
+            }
+
+            if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                // the kernel copied anyway (e.g. loopback), zerocopy only
+                // adds completion overhead for this connection
+                state.zerocopy_threshold = 0;
+            }
+        }
+    }
+
+    return found;
+}
+
 }   // namespace NRpc
@@ -1,81 +1,373 @@
+#include "checkpoint.h"
+#include "codec.h"
+#include "coro.h"
+#include "executor.h"
+#include "iolimit.h"
 #include "kv.pb.h"
 #include "log.h"
+#include "memory.h"
+#include "pool.h"
 #include "protocol.h"
+#include "queue.h"
+#include "reactor.h"
 #include "rpc.h"
-
-#include <array>
+#include "snapshot.h"
+#include "stats.h"
+#include "topology.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstdio>
 #include <cstring>
-#include <sstream>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
 #include <string>
+#include <string_view>
+#include <tuple>
 #include <unordered_map>
+#include <vector>
 
-#include <errno.h>
-#include <fcntl.h>
-#include <netdb.h>
-#include <unistd.h>
 #include <utility>
-#include <fstream>
 #include <thread>
 
-#include <sys/epoll.h>
-#include <sys/socket.h>
-#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
 
-static_assert(EAGAIN == EWOULDBLOCK);
+#include <sys/uio.h>
 
+using namespace NCoro;
 using namespace NLogging;
+using namespace NPool;
 using namespace NProtocol;
+using namespace NQueue;
+using namespace NReactor;
 using namespace NRpc;
 
 namespace {
 
 ////////////////////////////////////////////////////////////////////////////////
 
-constexpr int max_events = 32;
-
 const int SLEEP_TIME_MS = 2000;
 
-template<class K, class V>
-class FileWriteReadStrategy {
-    public:
-        virtual void writeToFile(const K& k, const V& v, std::ofstream& stream) = 0;
-        virtual std::pair<K, V> readFromFile(std::ifstream& stream) = 0;
+// capacity of every reactor -> reactor queue in shared-nothing mode
+constexpr size_t forward_queue_size = 4096;
+
+constexpr uint64_t background_io_burst = 1024 * 1024;
+
+NStats::Counter& puts_counter = NStats::counter("puts");
+// puts replaced by a later put of the same key before they were written
+NStats::Counter& coalesced_puts_counter = NStats::counter("coalesced_puts");
+// bytes appended to the values files
+NStats::Counter& written_bytes_counter = NStats::counter("written_bytes");
+NStats::Counter& gets_counter = NStats::counter("gets");
+// async gets that read the values file vs ones that joined such a read
+NStats::Counter& get_reads_counter = NStats::counter("get_reads");
+NStats::Counter& coalesced_gets_counter = NStats::counter("coalesced_gets");
+
+enum class EServerMode
+{
+    // reactors share one locked storage
+    SHARED,
+    // every reactor exclusively owns a shard of the keys
+    SHARED_NOTHING,
 };
 
-template<>
-class FileWriteReadStrategy<std::string, uint64_t> {
-    public:
-        void writeToFile(const std::string& k, const uint64_t& v, std::ofstream& stream) {
-            stream << k << ' ' << v << ' ';
+// storage settings of a namespace, "" is the default namespace
+struct NamespaceConfig
+{
+    std::string name;
+    int checkpoint_ms = SLEEP_TIME_MS;
+    // files (and threads) a checkpoint of the namespace's index is written
+    // to, loaded with as many threads on startup
+    size_t checkpoint_partitions = 4;
+    // bytes of index and staged values (of all shards) above which the
+    // namespace is flushed early and warned about, 0 is unlimited
+    int64_t memory_quota = 0;
+};
+
+struct ServerEnv
+{
+    // number of reactor threads, each with its own listening socket and epoll
+    int threads = 1;
+
+    EServerMode mode = EServerMode::SHARED;
+
+    // responses of at least this many bytes are sent with MSG_ZEROCOPY,
+    // 0 disables zerocopy
+    size_t zerocopy_threshold = 64 * 1024;
+
+    // v2 values of at least this many bytes are sent with sendfile straight
+    // from the values file, 0 always reads them into memory
+    size_t sendfile_threshold = 16 * 1024;
+
+    // size of the work-stealing pool running handlers and checkpoints in
+    // shared mode, 0 runs handlers on the reactors
+    int workers = 0;
+
+    // a dedicated thread accepts all connections and hands them to the
+    // reactors round-robin instead of every reactor listening on the port
+    bool acceptor = false;
+
+    // reactors poll epoll without sleeping for this long after an event
+    int spin_us = 0;
+    // SO_BUSY_POLL for the connections
+    int busy_poll_us = 0;
+
+    // the default namespace and the NAMESPACES ones
+    std::vector<NamespaceConfig> namespaces = {NamespaceConfig{}};
+
+    // tracked memory (NMemory accounts) above which pending writes are
+    // flushed early and cached buffers are freed, 0 is unlimited
+    int64_t memory_soft_limit = 0;
+    // above this the reactors also stop reading requests until usage drops
+    int64_t memory_hard_limit = 0;
+
+    // 0: keys are strings of any size, 16: every key is 16 bytes (e.g. a
+    // uuid) and the index stores them inline; fixed for a data directory
+    size_t key_size = 0;
+
+    // bytes per second the checkpoints may write, 0 is unlimited; the
+    // budget drops towards background_io_min_rate while foreground value
+    // reads take longer than foreground_read_target_us on average
+    uint64_t background_io_rate = 64 * 1024 * 1024;
+    uint64_t background_io_min_rate = 4 * 1024 * 1024;
+    // 0 keeps the rate fixed
+    uint64_t foreground_read_target_us = 1000;
+
+    ServerEnv()
+    {
+        if (auto value = std::getenv("THREADS")) {
+            threads = atoi(value);
+            VERIFY(threads > 0, "invalid THREADS");
+        }
+
+        if (auto value = std::getenv("MODE")) {
+            const std::string mode_name = value;
+            if (mode_name == "shared") {
+                mode = EServerMode::SHARED;
+            } else if (mode_name == "shared-nothing") {
+                mode = EServerMode::SHARED_NOTHING;
+            } else {
+                VERIFY(false, "invalid MODE");
+            }
+        }
+
+        if (auto value = std::getenv("ZEROCOPY_THRESHOLD")) {
+            zerocopy_threshold = strtoull(value, nullptr, 10);
+        }
+
+        if (auto value = std::getenv("SENDFILE_THRESHOLD")) {
+            sendfile_threshold = strtoull(value, nullptr, 10);
+        }
+
+        if (auto value = std::getenv("WORKERS")) {
+            workers = atoi(value);
+            VERIFY(workers >= 0, "invalid WORKERS");
+        }
+
+        if (auto value = std::getenv("ACCEPTOR")) {
+            acceptor = atoi(value) != 0;
+        }
+
+        if (auto value = std::getenv("SPIN_US")) {
+            spin_us = atoi(value);
+            VERIFY(spin_us >= 0, "invalid SPIN_US");
+        }
+
+        if (auto value = std::getenv("BUSY_POLL_US")) {
+            busy_poll_us = atoi(value);
+            VERIFY(busy_poll_us >= 0, "invalid BUSY_POLL_US");
+        }
+
+        if (auto value = std::getenv("NAMESPACES")) {
+            parse_namespaces(value);
+        }
+
+        if (auto value = std::getenv("CHECKPOINT_PARTITIONS")) {
+            const auto partitions = strtoull(value, nullptr, 10);
+            VERIFY(partitions > 0, "invalid CHECKPOINT_PARTITIONS");
+            for (auto& config: namespaces) {
+                config.checkpoint_partitions = partitions;
+            }
+        }
+
+        if (auto value = std::getenv("MEMORY_SOFT_LIMIT")) {
+            memory_soft_limit = strtoll(value, nullptr, 10);
+            VERIFY(memory_soft_limit >= 0, "invalid MEMORY_SOFT_LIMIT");
+        }
+
+        if (auto value = std::getenv("MEMORY_HARD_LIMIT")) {
+            memory_hard_limit = strtoll(value, nullptr, 10);
+            VERIFY(memory_hard_limit >= 0, "invalid MEMORY_HARD_LIMIT");
+        }
+
+        if (auto value = std::getenv("KEY_SIZE")) {
+            key_size = strtoull(value, nullptr, 10);
+            VERIFY(key_size == 0 || key_size == fixed_key_size,
+                "invalid KEY_SIZE");
+        }
+
+        if (auto value = std::getenv("BACKGROUND_IO_RATE")) {
+            background_io_rate = strtoull(value, nullptr, 10);
+        }
+
+        if (auto value = std::getenv("BACKGROUND_IO_MIN_RATE")) {
+            background_io_min_rate = strtoull(value, nullptr, 10);
         }
 
-        std::pair<std::string, uint64_t> readFromFile(std::ifstream& stream) {
-            std::string key;
-            uint64_t value;
-            stream >> key >> value;
-            return { key, value };
+        if (auto value = std::getenv("FOREGROUND_READ_TARGET_US")) {
+            foreground_read_target_us = strtoull(value, nullptr, 10);
         }
+    }
+
+    // reactors driving checkpoints wake up at least this often
+    int min_checkpoint_ms() const
+    {
+        int result = SLEEP_TIME_MS;
+        for (const auto& config: namespaces) {
+            result = std::min(result, config.checkpoint_ms);
+        }
+        return result;
+    }
+
+    // name[:checkpoint_ms[:memory_quota]],...
+    void parse_namespaces(const std::string& value)
+    {
+        size_t pos = 0;
+        while (pos <= value.size()) {
+            auto end = value.find(',', pos);
+            if (end == std::string::npos) {
+                end = value.size();
+            }
+
+            const auto item = value.substr(pos, end - pos);
+            pos = end + 1;
+
+            NamespaceConfig config;
+            const auto colon = item.find(':');
+            config.name = item.substr(0, colon);
+            if (colon != std::string::npos) {
+                config.checkpoint_ms = atoi(item.c_str() + colon + 1);
+                VERIFY(config.checkpoint_ms > 0, "invalid NAMESPACES");
+
+                const auto quota = item.find(':', colon + 1);
+                if (quota != std::string::npos) {
+                    config.memory_quota = atoll(item.c_str() + quota + 1);
+                    VERIFY(config.memory_quota >= 0, "invalid NAMESPACES");
+                }
+            }
+
+            VERIFY(!config.name.empty() && std::all_of(
+                config.name.begin(),
+                config.name.end(),
+                [] (char c) {
+                    return isalnum(c) || c == '_';
+                }), "invalid NAMESPACES");
+            for (const auto& other: namespaces) {
+                VERIFY(other.name != config.name, "duplicate NAMESPACES");
+            }
+
+            namespaces.push_back(std::move(config));
+        }
+    }
 };
 
-template<class K, class V>
+// index key of the request key bytes, fixed-size keys of the wrong size
+// never reach the index
+template<class TKey>
+TKey to_key(std::string_view bytes);
+
+template<>
+std::string to_key<std::string>(std::string_view bytes) {
+    return std::string(bytes);
+}
+
+template<>
+NCodec::Key16 to_key<NCodec::Key16>(std::string_view bytes) {
+    VERIFY(bytes.size() == sizeof(NCodec::Key16), "invalid fixed-size key");
+    NCodec::Key16 key;
+    memcpy(&key, bytes.data(), sizeof(key));
+    return key;
+}
+
+template<class TKey>
+bool is_valid_key(std::string_view bytes) {
+    if constexpr (std::is_same_v<TKey, NCodec::Key16>) {
+        return bytes.size() == sizeof(NCodec::Key16);
+    }
+    return true;
+}
+
+// lock for tables owned by a single thread (shared-nothing mode)
+struct NoopMutex {
+    void lock() {}
+    void unlock() {}
+};
+
+// keys and values are stored with their NCodec::Codec, the checkpoint is a
+// set of partitions of plain records under a manifest (NCheckpoint); the
+// log is kept by the owner (the shard's write-ahead log), which replays it,
+// logs the pending puts and then applies them: db only ever holds logged
+// puts, so a checkpoint never refers to a value that may not survive a crash
+template<NCodec::Codable K, NCodec::Codable V, class TMutex = std::mutex>
 class PersistentHashTable {
     public:
+        // the entries are charged to account, checkpoint writes are
+        // throttled by limiter when given
         PersistentHashTable(
-            FileWriteReadStrategy<K, V> fileWriteReadStrategy,
-            std::string& logsPath_,
-            std::string& dbPath_
-        ): logsPath(logsPath_), dbPath(dbPath_)  {
-            fwrs = fileWriteReadStrategy;
-            logsPath = logsPath_;
-            dbPath = dbPath_;
-
-            auto dropper = [&] () {
+            const std::string& prefix_,
+            size_t partitions_,
+            NMemory::Account& account,
+            NIoLimit::TokenBucket* limiter_ = nullptr
+        ): pendingLog(NMemory::CountingAllocator<Entry>(&account)),
+           pendingIndex(NMemory::CountingAllocator<MapEntry>(&account)),
+           db(NMemory::CountingAllocator<MapEntry>(&account)),
+           prefix(prefix_), partitions(partitions_), limiter(limiter_)  {
+            manifest = NCheckpoint::read_manifest(prefix);
+            auto records = NCheckpoint::read_partitions<K, V>(manifest);
+
+            size_t total = 0;
+            for (auto& part: records) {
+                total += part.size();
+            }
+            db.reserve(total);
+            // the partitions hold disjoint keys, the legacy file may repeat
+            // one, the later record wins
+            for (auto& part: records) {
+                for (auto& entry: part) {
+                    db[entry.first] = entry.second;
+                }
+                part = {};
+            }
+        }
+
+        // startup only, before the table is shared
+        void replay(const K& key, const V& value) {
+            db[key] = value;
+        }
+
+        // the values file the checkpoint points into
+        const std::string& valuesPath() const {
+            return manifest.values;
+        }
+
+        // calls dropTable() every intervalMs from a background thread,
+        // otherwise the owner calls it itself; started after the log is
+        // replayed, an early drop would checkpoint an incomplete db
+        void startDropper(int intervalMs) {
+            auto dropper = [this, intervalMs] () {
+                NTopology::make_current_thread_background();
                 while (true) {
                     if (this->cancelThread) {
                         return;
                     }
-                    std::this_thread::sleep_for(std::chrono::milliseconds(SLEEP_TIME_MS));
+                    std::this_thread::sleep_for(std::chrono::milliseconds(intervalMs));
                     if (this->cancelThread) {
                         return;
                     }
@@ -84,444 +376,2331 @@ class PersistentHashTable {
             };
 
             dropThread = std::thread(dropper);
+        }
 
-            std::ifstream logsStream(logsPath);
-            std::ifstream dbStream(dbPath);
-            if (dbStream.good()) {
-                int cnt;
-                dbStream >> cnt;
-                for (int i = 0; i < cnt; i++) {
-                    auto pair = fwrs.readFromFile(dbStream);
-                    db[pair.first] = pair.second;
-                }
+        void put(const K& key, const V& value) {
+            std::lock_guard<TMutex> guard(dbMutex);
+            pendingLog.push_back({ key, value });
+            pendingIndex[key] = value;
+        }
+
+        // returns a copy: references into db or pendingLog are invalidated
+        // as soon as another reactor thread takes dbMutex
+        std::optional<V> get(const K& key) {
+            std::lock_guard<TMutex> guard(dbMutex);
+            auto pending = pendingIndex.find(key);
+            if (pending != pendingIndex.end()) {
+                return pending->second;
             }
 
-            if (logsStream.good()) {
-                int cnt;
-                logsStream >> cnt;
-                for (int i = 0; i < cnt; i++) {
-                    auto pair = fwrs.readFromFile(logsStream);
-                    db[pair.first] = pair.second;
-                }
+            auto it = db.find(key);
+            if (it == db.end()) {
+                return std::nullopt;
+            } else {
+                return it->second;
             }
         }
 
-        void put(const K& key, const V& value) {
-            std::lock_guard<std::mutex> guard(dbMutex);
-            pendingLog.push_back({ key, value });
-            if (!dropping) {
-                db[key] = value;
+        // puts all of entries under one lock, i.e. they become visible at
+        // once
+        void putBatch(const std::vector<std::pair<K, V>>& entries) {
+            std::lock_guard<TMutex> guard(dbMutex);
+            pendingLog.insert(pendingLog.end(), entries.begin(), entries.end());
+            for (auto& [key, value]: entries) {
+                pendingIndex[key] = value;
             }
         }
 
-        V* get(const K& key) {
-            std::lock_guard<std::mutex> guard(dbMutex);
-            if (pendingLog.size() > 0) {
-                for (int i = pendingLog.size() - 1; i >= 0; i--) {
-                    if (pendingLog[i].first == key) {
-                        return &pendingLog[i].second;
-                    }
+        // the entries at this instant, pending puts included
+        std::vector<std::pair<K, V>> snapshot() {
+            std::lock_guard<TMutex> guard(dbMutex);
+            std::vector<std::pair<K, V>> entries(
+                pendingIndex.begin(),
+                pendingIndex.end());
+            entries.reserve(db.size() + pendingIndex.size());
+            for (auto& entry: db) {
+                if (!pendingIndex.count(entry.first)) {
+                    entries.push_back(entry);
                 }
             }
+            return entries;
+        }
 
-            if (db.find(key) == db.end()) {
-                return NULL;
-            } else {
-                return &db[key];
+        void dropTable() {
+            if (auto id = startCheckpoint()) {
+                writeCheckpoint(id);
             }
         }
 
-        void dropTable() {
-            {
-                std::lock_guard<std::mutex> guard(dbMutex);
-                dropping = true;
+        // freezes db for a checkpoint and numbers it, 0 if one is running
+        // already; called by the thread that applies the logged puts, the
+        // checkpoint itself may then be written on any thread
+        uint64_t startCheckpoint() {
+            std::lock_guard<TMutex> guard(dbMutex);
+            if (dropping) {
+                return 0;
             }
-            std::ofstream dbStream(dbPath, std::ios_base::trunc);
-            dbStream << db.size() << ' ';
-            for (auto& entry: db) {
-                fwrs.writeToFile(entry.first, entry.second, dbStream);
+            dropping = true;
+            return ++checkpointsStarted;
+        }
+
+        // writes the checkpoint started as id and unfreezes db
+        void writeCheckpoint(uint64_t id) {
+            // db is not written to while dropping, the partition threads
+            // read it without the lock
+            std::function<void(size_t)> throttle;
+            if (limiter) {
+                throttle = [this] (size_t bytes) {
+                    limiter->acquire(bytes);
+                };
+            }
+            auto written = NCheckpoint::write_partitions<K, V>(
+                prefix,
+                manifest.generation + 1,
+                db,
+                partitions,
+                throttle);
+            if (written) {
+                written->values = manifest.values;
+            }
+
+            if (!written) {
+                LOG_ERROR_S("failed to write checkpoint of " << prefix
+                    << "db, keeping the previous one");
+            } else if (!NCheckpoint::commit_manifest(prefix, *written)) {
+                LOG_ERROR_S("failed to commit checkpoint of " << prefix
+                    << "db, keeping the previous one");
+                NCheckpoint::remove_replaced(*written, manifest);
+            } else {
+                NCheckpoint::remove_replaced(manifest, *written);
+                manifest = std::move(*written);
+                lastCheckpoint = id;
             }
-            dbStream.flush();
-            dbStream.close();
             {
-                std::lock_guard<std::mutex> guard(dbMutex);
+                std::lock_guard<TMutex> guard(dbMutex);
                 dropping = false;
             }
         }
 
-        void dropLogs() {
-            std::lock_guard<std::mutex> guard(dbMutex);
-            std::ofstream logsStream(logsPath, std::ios_base::trunc);
-            logsStream << pendingLog.size() << ' ';
-            for (auto& entry: pendingLog) {
-                fwrs.writeToFile(entry.first, entry.second, logsStream);
+        // passes the pending puts that are not logged yet to sink(key,
+        // value) for the log
+        template<class TFunc>
+        void logPending(TFunc&& sink) {
+            std::lock_guard<TMutex> guard(dbMutex);
+            for (size_t i = logged; i < pendingLog.size(); ++i) {
+                sink(pendingLog[i].first, pendingLog[i].second);
             }
-            if (!dropping) {
-                for (auto& entry: pendingLog) {
-                    db[entry.first] = entry.second;
-                }
-                pendingLog.clear();
+            logged = pendingLog.size();
+        }
+
+        // moves the logged puts to db once the owner made the log durable,
+        // they wait while a checkpoint reads db
+        void applyLogged() {
+            std::lock_guard<TMutex> guard(dbMutex);
+            if (dropping || !logged) {
+                return;
+            }
+
+            for (size_t i = 0; i < logged; ++i) {
+                db[pendingLog[i].first] = pendingLog[i].second;
+            }
+            pendingLog.erase(pendingLog.begin(), pendingLog.begin() + logged);
+            logged = 0;
+
+            pendingIndex.clear();
+            for (auto& entry: pendingLog) {
+                pendingIndex[entry.first] = entry.second;
             }
-            logsStream.flush();
-            logsStream.close();
+        }
+
+        // the next logPending() passes every pending put again, for a new
+        // log file
+        void relogPending() {
+            std::lock_guard<TMutex> guard(dbMutex);
+            logged = 0;
+        }
+
+        // checkpoints started so far, a later one has every put applied
+        // before it
+        uint64_t checkpointMark() {
+            std::lock_guard<TMutex> guard(dbMutex);
+            return checkpointsStarted;
+        }
+
+        bool checkpointedSince(uint64_t mark) const {
+            return lastCheckpoint.load() > mark;
         }
 
         ~PersistentHashTable() {
             cancelThread = true;
-            dropThread.join();
-            dropLogs();
+            if (dropThread.joinable()) {
+                dropThread.join();
+            }
         }
 
     private:
-        std::vector<std::pair<K, V>> pendingLog;
-        std::unordered_map<K, V> db;
-        FileWriteReadStrategy<K, V> fwrs;
-        std::string& logsPath;
-        std::string& dbPath;
-        std::mutex dbMutex;
+        using Entry = std::pair<K, V>;
+        using MapEntry = std::pair<const K, V>;
+        using Map = std::unordered_map<
+            K,
+            V,
+            std::hash<K>,
+            std::equal_to<K>,
+            NMemory::CountingAllocator<MapEntry>>;
+
+        std::vector<Entry, NMemory::CountingAllocator<Entry>> pendingLog;
+        // pendingLog[0, logged) are in the log
+        size_t logged = 0;
+        // latest pendingLog entry per key, a batch of puts between two
+        // drains can be large
+        Map pendingIndex;
+        Map db;
+        // "<prefix>db.manifest" and its partitions
+        std::string prefix;
+        size_t partitions;
+        NCheckpoint::Manifest manifest;
+        uint64_t checkpointsStarted = 0;
+        // number of the last committed checkpoint
+        std::atomic<uint64_t> lastCheckpoint = 0;
+        NIoLimit::TokenBucket* limiter;
+        TMutex dbMutex;
         std::thread dropThread;
-        bool dropping = false;
+        // atomic: with NoopMutex the flag is how the owner and the thread
+        // writing a checkpoint hand db over to each other
+        std::atomic<bool> dropping = false;
         bool cancelThread = false;
 };
 
+// the index maps TKey (std::string or a fixed-size NCodec::Key16) to
+// value offsets, callers always pass the request's key bytes
+template<class TKey, class TMutex = std::mutex>
 class BinaryPersistentHashTable {
     public:
+        // staged values are charged to stagedAccount, reads are reported
+        // to limiter, which tunes the background budget
         BinaryPersistentHashTable(
             std::string binary_file_path_,
-            PersistentHashTable<std::string, uint64_t>& table_
-        ): table(table_) {
-            f = fopen(binary_file_path_.c_str(), "ab+");
+            PersistentHashTable<TKey, uint64_t, TMutex>& table_,
+            NMemory::Account& stagedAccount_,
+            NIoLimit::TokenBucket* limiter_ = nullptr
+        ): table(table_), stagedAccount(stagedAccount_), limiter(limiter_) {
+            // no O_APPEND: pwrite would ignore the reserved offsets
+            fd = open(binary_file_path_.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+            VERIFY(fd != -1, "failed to open values file");
+            end = lseek(fd, 0, SEEK_END);
         }
 
         std::string get(const std::string& key) {
-            uint64_t* offset = table.get(key);
-            if (offset == NULL) {
+            auto offset = locate(key);
+            if (!offset) {
                 return "";
             }
-            fseek(f, *offset, SEEK_SET);
-            uint64_t sz;
-            fread(&sz, sizeof(uint64_t), 1, f);
-            std::string ret(sz, 0);
-            fread(&ret[0], sizeof(char), sz, f);
-            fseek(f, 0, SEEK_END);
-            return ret;
+            return read(*offset);
         }
 
-        void put(const std::string& key, const std::string& value) {
-            uint64_t sz = value.size();
-            uint64_t offset = ftell(f);
-            fwrite(&sz, sizeof(uint64_t), 1, f);
-            fwrite(value.c_str(), sizeof(char), sz, f);
-            table.put(key, offset);
+        void put(const std::string& key, std::string_view value) {
+            auto offset = append(value);
+            VERIFY(offset, "failed to write values file");
+            table.put(to_key<TKey>(key), *offset);
         }
 
-    private:
-        PersistentHashTable<std::string, uint64_t>& table;
-        FILE* f;
-};
-
-////////////////////////////////////////////////////////////////////////////////
-
-auto create_and_bind(std::string const& port)
-{
-    struct addrinfo hints;
-
-    memset(&hints, 0, sizeof(struct addrinfo));
-    hints.ai_family = AF_UNSPEC; /* Return IPv4 and IPv6 choices */
-    hints.ai_socktype = SOCK_STREAM; /* TCP */
-    hints.ai_flags = AI_PASSIVE; /* All interfaces */
-
-    struct addrinfo* result;
-    int sockt = getaddrinfo(nullptr, port.c_str(), &hints, &result);
-    if (sockt != 0) {
-        LOG_ERROR("getaddrinfo failed");
-        return -1;
-    }
-
-    struct addrinfo* rp = nullptr;
-    int socketfd = 0;
-    for (rp = result; rp != nullptr; rp = rp->ai_next) {
-        socketfd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
-        if (socketfd == -1) {
-            continue;
+        // buffers the write until commit(), a later write of the same key
+        // replaces it, so a batch writes every key to the values file and to
+        // the log at most once
+        void stage(const std::string& key, std::string_view value) {
+            std::lock_guard<TMutex> guard(stagedMutex);
+            auto [it, inserted] = staged.try_emplace(key);
+            int64_t delta = value.size();
+            if (!inserted) {
+                ::coalesced_puts_counter.add(1);
+                delta -= it->second.size();
+            } else {
+                delta += key.size();
+            }
+            stagedBytes += delta;
+            stagedAccount.add(delta);
+            it->second.assign(value.data(), value.size());
         }
 
-        sockt = bind(socketfd, rp->ai_addr, rp->ai_addrlen);
-        if (sockt == 0) {
-            break;
+        // a write that is not in the index yet
+        std::optional<std::string> staged_value(const std::string& key) {
+            std::lock_guard<TMutex> guard(stagedMutex);
+            auto it = staged.find(key);
+            if (it == staged.end()) {
+                return std::nullopt;
+            }
+            return it->second;
         }
 
-        close(socketfd);
-    }
+        // appends the staged values with one reservation and a few large
+        // positional writes and then points the index at them, the caller
+        // makes the index log durable afterwards; staged values stay visible
+        // until the index has them, false (and nothing indexed) if the write
+        // failed
+        bool commit() {
+            std::lock_guard<TMutex> guard(stagedMutex);
+            if (staged.empty()) {
+                return true;
+            }
 
-    if (rp == nullptr) {
-        LOG_ERROR("bind failed");
-        return -1;
-    }
+            std::vector<uint64_t> sizes;
+            sizes.reserve(staged.size());
+            uint64_t total = 0;
+            for (auto& [key, value]: staged) {
+                sizes.push_back(value.size());
+                total += sizeof(uint64_t) + value.size();
+            }
 
-    freeaddrinfo(result);
+            const uint64_t start = end.fetch_add(total);
 
-    return socketfd;
-}
+            std::vector<struct iovec> iov;
+            iov.reserve(2 * staged.size());
+            size_t i = 0;
+            for (auto& [key, value]: staged) {
+                iov.push_back({ &sizes[i], sizeof(uint64_t) });
+                iov.push_back({ value.data(), value.size() });
+                ++i;
+            }
 
-////////////////////////////////////////////////////////////////////////////////
+            if (!NCodec::pwritev_all(fd, iov.data(), iov.size(), start)) {
+                return false;
+            }
 
-auto make_socket_nonblocking(int socketfd)
-{
-    int flags = fcntl(socketfd, F_GETFL, 0);
-    if (flags == -1) {
-        LOG_ERROR("fcntl failed (F_GETFL)");
-        return false;
-    }
+            uint64_t offset = start;
+            i = 0;
+            for (auto& [key, value]: staged) {
+                table.put(to_key<TKey>(key), offset);
+                offset += sizeof(uint64_t) + sizes[i];
+                ++i;
+            }
 
-    flags |= O_NONBLOCK;
-    int s = fcntl(socketfd, F_SETFL, flags);
-    if (s == -1) {
-        LOG_ERROR("fcntl failed (F_SETFL)");
-        return false;
-    }
+            ::written_bytes_counter.add(total);
+            staged.clear();
+            stagedAccount.add(-stagedBytes);
+            stagedBytes = 0;
+            return true;
+        }
 
-    return true;
-}
+        // index lookup only, no io
+        std::optional<uint64_t> locate(const std::string& key) {
+            if (!is_valid_key<TKey>(key)) {
+                return std::nullopt;
+            }
+            return table.get(to_key<TKey>(key));
+        }
 
-////////////////////////////////////////////////////////////////////////////////
-SocketStatePtr invalid_state()
-{
-    return std::make_shared<SocketState>();
-}
+        // points the index at a record written by append()
+        void link(const std::string& key, uint64_t offset) {
+            table.put(to_key<TKey>(key), offset);
+        }
 
+        // positional io, safe to call from any thread
+        std::string read(uint64_t offset) {
+            const auto started = std::chrono::steady_clock::now();
 
-SocketStatePtr accept_connection(
-    int socketfd,
-    struct epoll_event& event,
-    int epollfd)
-{
-    struct sockaddr in_addr;
-    socklen_t in_len = sizeof(in_addr);
-    int infd = accept(socketfd, &in_addr, &in_len);
-    if (infd == -1) {
-        if (errno == EAGAIN || errno == EWOULDBLOCK) {
-            return nullptr;
-        } else {
-            LOG_ERROR("accept failed");
-            return invalid_state();
+            auto ret = readRecord(offset);
+
+            if (limiter) {
+                limiter->observe_foreground(
+                    std::chrono::steady_clock::now() - started);
+            }
+            return ret;
         }
-    }
 
-    std::string hbuf(NI_MAXHOST, '\0');
-    std::string sbuf(NI_MAXSERV, '\0');
-    auto ret = getnameinfo(
-        &in_addr, in_len,
-        const_cast<char*>(hbuf.data()), hbuf.size(),
-        const_cast<char*>(sbuf.data()), sbuf.size(),
-        NI_NUMERICHOST | NI_NUMERICSERV);
+        // writes a block of whole records at the end of the file with one
+        // positional write, returns its offset
+        std::optional<uint64_t> appendBlock(std::string_view block) {
+            const uint64_t offset = end.fetch_add(block.size());
+            uint64_t written = 0;
+            while (written < block.size()) {
+                const auto n = pwrite(
+                    fd,
+                    block.data() + written,
+                    block.size() - written,
+                    offset + written);
+                if (n < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (n <= 0) {
+                    return std::nullopt;
+                }
+                written += n;
+            }
+            ::written_bytes_counter.add(block.size());
+            return offset;
+        }
 
-    if (ret == 0) {
-        LOG_INFO_S("accepted connection on fd " << infd
-            << "(host=" << hbuf << ", port=" << sbuf << ")");
-    }
+        // makes the appended records durable
+        bool sync() {
+            return fdatasync(fd) == 0;
+        }
 
-    if (!make_socket_nonblocking(infd)) {
-        LOG_ERROR("make_socket_nonblocking failed");
-        return invalid_state();
-    }
+        // read() for background readers, not reported to the limiter
+        std::string readRecord(uint64_t offset) {
+            uint64_t sz = 0;
+            if (pread(fd, &sz, sizeof(uint64_t), offset) != sizeof(uint64_t)) {
+                return "";
+            }
+            std::string ret(sz, 0);
+            if (pread(fd, &ret[0], sz, offset + sizeof(uint64_t)) != (ssize_t) sz) {
+                return "";
+            }
+            return ret;
+        }
 
-    event.data.fd = infd;
-    event.events = EPOLLIN | EPOLLOUT | EPOLLET;
-    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, infd, &event) == -1) {
-        LOG_ERROR("epoll_ctl failed");
-        return invalid_state();
-    }
+        // where the value bytes of the record at offset live in the file
+        FileRegion region(uint64_t offset) {
+            uint64_t sz = 0;
+            if (pread(fd, &sz, sizeof(uint64_t), offset) != sizeof(uint64_t)) {
+                return { fd, offset, 0 };
+            }
+            return { fd, offset + sizeof(uint64_t), sz };
+        }
 
-    auto state = std::make_shared<SocketState>();
-    state->fd = infd;
-    return state;
-}
+        // reserves space at the end of the file and writes the record there,
+        // concurrent appenders never overlap; nullopt if the write failed
+        std::optional<uint64_t> append(std::string_view value) {
+            uint64_t sz = value.size();
+            uint64_t offset = end.fetch_add(sizeof(uint64_t) + sz);
+            struct iovec iov[2] = {
+                { &sz, sizeof(uint64_t) },
+                { const_cast<char*>(value.data()), sz },
+            };
+            if (!NCodec::pwritev_all(fd, iov, 2, offset)) {
+                return std::nullopt;
+            }
+            ::written_bytes_counter.add(sizeof(uint64_t) + sz);
+            return offset;
+        }
 
-}   // namespace
+        ~BinaryPersistentHashTable() {
+            close(fd);
+        }
+
+    private:
+        PersistentHashTable<TKey, uint64_t, TMutex>& table;
+        NMemory::Account& stagedAccount;
+        NIoLimit::TokenBucket* limiter;
+        int fd;
+        std::atomic<uint64_t> end;
+        TMutex stagedMutex;
+        std::unordered_map<std::string, std::string> staged;
+        // key and value bytes of staged, charged to stagedAccount
+        int64_t stagedBytes = 0;
+};
 
 ////////////////////////////////////////////////////////////////////////////////
 
-int main(int argc, const char** argv)
+// named keyspace with its own index, values file and checkpoint interval,
+// the shard's log is shared by all of its namespaces
+template<class TKey, class TMutex>
+struct Namespace
 {
-    if (argc < 2) {
-        return 1;
+    const std::string name;
+    const size_t index;
+    const int checkpoint_ms;
+    const int64_t memory_quota;
+
+    // "memory.<name>.index" / "memory.<name>.staged", shared by the shards
+    NMemory::Account index_memory;
+    NMemory::Account staged_memory;
+
+    PersistentHashTable<TKey, uint64_t, TMutex> table;
+    BinaryPersistentHashTable<TKey, TMutex> values;
+
+    // checkpoints driven by the owner instead of the table's own thread
+    std::atomic<bool> checkpointing = false;
+    std::chrono::steady_clock::time_point last_checkpoint =
+        std::chrono::steady_clock::now();
+    // writes the checkpoints started by start_checkpoint_thread
+    std::thread checkpoint_thread;
+
+    // files of the default namespace ("") are not prefixed with its name
+    Namespace(
+            const std::string& prefix,
+            const NamespaceConfig& config,
+            size_t index,
+            NIoLimit::TokenBucket* limiter)
+        : name(config.name)
+        , index(index)
+        , checkpoint_ms(config.checkpoint_ms)
+        , memory_quota(config.memory_quota)
+        , index_memory(stat_prefix(name) + "index")
+        , staged_memory(stat_prefix(name) + "staged")
+        , table(
+            file_prefix(prefix, name),
+            config.checkpoint_partitions,
+            index_memory,
+            limiter)
+        , values(
+            table.valuesPath(),
+            table,
+            staged_memory,
+            limiter)
+    {
     }
 
-    /*
-     * socket creation and epoll boilerplate
-     * TODO extract into struct Bootstrap
-     */
-
-    auto socketfd = ::create_and_bind(argv[1]);
-    if (socketfd == -1) {
-        return 1;
+    ~Namespace()
+    {
+        if (checkpoint_thread.joinable()) {
+            checkpoint_thread.join();
+        }
     }
 
-    if (!::make_socket_nonblocking(socketfd)) {
-        return 1;
-    }
+    // the owner freezes the index, a background thread writes it: the
+    // owner's thread neither does the io nor waits for the limiter;
+    // false while the previous checkpoint is still being written
+    bool start_checkpoint_thread()
+    {
+        if (checkpointing.exchange(true)) {
+            return false;
+        }
+        if (checkpoint_thread.joinable()) {
+            checkpoint_thread.join();
+        }
 
-    if (listen(socketfd, SOMAXCONN) == -1) {
-        LOG_ERROR("listen failed");
-        return 1;
+        const auto id = table.startCheckpoint();
+        checkpoint_thread = std::thread([this, id] () {
+            NTopology::make_current_thread_background();
+            if (id) {
+                table.writeCheckpoint(id);
+            }
+            checkpointing = false;
+        });
+        return true;
     }
 
-    int epollfd = epoll_create1(0);
-    if (epollfd == -1) {
-        LOG_ERROR("epoll_create1 failed");
-        return 1;
+    static std::string stat_prefix(const std::string& name)
+    {
+        return name.empty() ? "" : name + ".";
     }
 
-    struct epoll_event event;
-    event.data.fd = socketfd;
-    event.events = EPOLLIN | EPOLLET;
-    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, socketfd, &event) == -1) {
-        LOG_ERROR("epoll_ctl failed");
-        return 1;
+    bool over_quota() const
+    {
+        return memory_quota
+            && index_memory.bytes() + staged_memory.bytes() >= memory_quota;
     }
 
-    /*
-     * handler function
-     */
-    FileWriteReadStrategy<std::string, uint64_t> fwrs;
-    std::string logs = "logs.txt";
-    std::string db = "db.txt";
-    PersistentHashTable<std::string, uint64_t> st(fwrs, logs, db);
-
-    std::string binDb = "values.bin";
-    BinaryPersistentHashTable binaryDb(binDb, st);
+    static std::string file_prefix(
+        const std::string& prefix,
+        const std::string& name)
+    {
+        return name.empty() ? prefix : prefix + name + ".";
+    }
 
-    auto handle_get = [&] (const std::string& request) {
-        NProto::TGetRequest get_request;
-        if (!get_request.ParseFromArray(request.data(), request.size())) {
-            // TODO proper handling
+    bool checkpoint_due(std::chrono::steady_clock::time_point now) const
+    {
+        return now - last_checkpoint
+            >= std::chrono::milliseconds(checkpoint_ms);
+    }
+};
 
-            abort();
+/*
+ * the namespaces of one storage, with one write-ahead log for all of them:
+ * a group commit writes the puts of every namespace with a single write
+ * log record: namespace name, key, value offset
+ *
+ * the log is only appended to; when it has records it is sealed (renamed
+ * to "wal.old.bin") and a new one is started, the sealed one is deleted
+ * once every namespace has committed a checkpoint started after that, so
+ * recovery always finds the checkpoints plus the log records after them
+ */
+template<class TKey, class TMutex>
+struct Shard
+{
+    std::vector<std::unique_ptr<Namespace<TKey, TMutex>>> spaces;
+    std::string wal_path;
+    std::string old_wal_path;
+    int wal_fd = -1;
+    uint64_t wal_size = 0;
+    // the sealed log exists, checkpoints of the namespaces started after
+    // their marks cover it
+    bool sealed = false;
+    std::vector<uint64_t> marks;
+    TMutex wal_mutex;
+
+    // without backgroundDrop the owner checkpoints the namespaces itself
+    Shard(
+            const std::string& prefix,
+            const std::vector<NamespaceConfig>& namespaces,
+            bool backgroundDrop,
+            NIoLimit::TokenBucket* limiter)
+        : wal_path(prefix + "wal.bin")
+        , old_wal_path(prefix + "wal.old.bin")
+    {
+        for (size_t i = 0; i < namespaces.size(); ++i) {
+            spaces.push_back(std::make_unique<Namespace<TKey, TMutex>>(
+                prefix,
+                namespaces[i],
+                i,
+                limiter));
         }
 
-        LOG_DEBUG_S("get_request: " << get_request.ShortDebugString());
+        replay();
 
-        NProto::TGetResponse get_response;
-        get_response.set_request_id(get_request.request_id());
-        std::string it = binaryDb.get(get_request.key());
-        if (it != "") {
-            get_response.set_offset(it);
+        if (backgroundDrop) {
+            for (auto& space: spaces) {
+                space->table.startDropper(space->checkpoint_ms);
+            }
         }
+    }
 
-        std::stringstream response;
-        serialize_header(GET_RESPONSE, get_response.ByteSizeLong(), response);
-        get_response.SerializeToOstream(&response);
-
-        return response.str();
-    };
-
-    auto handle_put = [&] (const std::string& request) {
-        NProto::TPutRequest put_request;
-        if (!put_request.ParseFromArray(request.data(), request.size())) {
-            // TODO proper handling
+    ~Shard()
+    {
+        flush();
+        close(wal_fd);
+    }
 
-            abort();
+    // nullptr for an unknown namespace
+    Namespace<TKey, TMutex>* find(std::string_view name)
+    {
+        for (auto& space: spaces) {
+            if (space->name == name) {
+                return space.get();
+            }
         }
 
-        LOG_DEBUG_S("put_request: " << put_request.ShortDebugString());
+        return nullptr;
+    }
 
-        binaryDb.put(put_request.key(), put_request.offset());
+    // group commit: staged writes go to the values files, they and then the
+    // log are synced, only then the index applies the puts
+    void flush()
+    {
+        std::lock_guard<TMutex> guard(wal_mutex);
+
+        rotate();
+
+        std::string buffer;
+        std::vector<Namespace<TKey, TMutex>*> written;
+        for (auto& space: spaces) {
+            VERIFY(space->values.commit(), "failed to write values file");
+
+            const auto size = buffer.size();
+            space->table.logPending([&] (const TKey& key, uint64_t offset) {
+                NCodec::Codec<std::string>::write(buffer, space->name);
+                NCodec::append_record(buffer, key, offset);
+            });
+            if (buffer.size() != size) {
+                written.push_back(space.get());
+            }
+        }
 
-        NProto::TPutResponse put_response;
-        put_response.set_request_id(put_request.request_id());
+        if (!buffer.empty()) {
+            for (auto* space: written) {
+                VERIFY(space->values.sync(), "failed to sync values file");
+            }
+            VERIFY(NCodec::write_all(wal_fd, buffer) && fdatasync(wal_fd) == 0,
+                "failed to write log file");
+            wal_size += buffer.size();
+        }
 
-        std::stringstream response;
-        serialize_header(PUT_RESPONSE, put_response.ByteSizeLong(), response);
-        put_response.SerializeToOstream(&response);
+        for (auto& space: spaces) {
+            space->table.applyLogged();
+        }
+    }
 
-        return response.str();
-    };
+private:
+    // deletes the sealed log once it is covered, seals a log with records
+    void rotate()
+    {
+        if (sealed) {
+            for (size_t i = 0; i < spaces.size(); ++i) {
+                if (!spaces[i]->table.checkpointedSince(marks[i])) {
+                    return;
+                }
+            }
 
-    Handler handler = [&] (char request_type, const std::string& request) {
-        switch (request_type) {
-            case PUT_REQUEST: return handle_put(request);
-            case GET_REQUEST: return handle_get(request);
+            unlink(old_wal_path.c_str());
+            NCheckpoint::sync_directory(old_wal_path);
+            sealed = false;
         }
 
-        // TODO proper handling
+        if (!wal_size) {
+            return;
+        }
 
-        abort();
-        return std::string();
-    };
+        VERIFY(rename(wal_path.c_str(), old_wal_path.c_str()) == 0,
+            "failed to seal log file");
+        close(wal_fd);
+        open_log();
+        wal_size = 0;
+        NCheckpoint::sync_directory(wal_path);
+
+        // puts not applied yet are logged again, the sealed log may go
+        // before a checkpoint has them
+        marks.clear();
+        for (auto& space: spaces) {
+            marks.push_back(space->table.checkpointMark());
+            space->table.relogPending();
+        }
+        sealed = true;
+    }
 
-    /*
-     * rpc state and event loop
-     * TODO extract into struct Rpc
-     */
+    void open_log()
+    {
+        wal_fd = open(
+            wal_path.c_str(),
+            O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+            0644);
+        VERIFY(wal_fd != -1, "failed to open log file");
+    }
 
-    std::array<struct epoll_event, ::max_events> events;
-    std::unordered_map<int, SocketStatePtr> states;
+    // the records of the sealed log then of the current one; a torn record
+    // at the end of the current log is cut off, appends go after it
+    void replay()
+    {
+        auto apply = [this] (const std::string& data) {
+            std::string_view in = data;
+
+            std::string name;
+            TKey key{};
+            uint64_t offset = 0;
+            while (true) {
+                auto rest = in;
+                if (!NCodec::Codec<std::string>::read(rest, name)
+                        || !NCodec::Codec<TKey>::read(rest, key)
+                        || !NCodec::Codec<uint64_t>::read(rest, offset))
+                {
+                    break;
+                }
 
-    auto finalize = [&] (int fd) {
-        LOG_INFO_S("close " << fd);
+                auto* space = find(name);
+                VERIFY(space,
+                    "log refers to an unknown namespace, check NAMESPACES");
+                space->table.replay(key, offset);
+                in = rest;
+            }
 
-        close(fd);
-        states.erase(fd);
-    };
+            return data.size() - in.size();
+        };
 
-    while (true) {
-        const auto n = epoll_wait(epollfd, events.data(), ::max_events, -1);
+        if (access(old_wal_path.c_str(), F_OK) == 0) {
+            apply(NCodec::read_file(old_wal_path));
+            // the replayed records are in db, any next checkpoint has them
+            sealed = true;
+            marks.assign(spaces.size(), 0);
+        }
 
-        {
-            LOG_INFO_S("got " << n << " events");
+        const auto data = NCodec::read_file(wal_path);
+        wal_size = apply(data);
+        if (wal_size != data.size()) {
+            LOG_WARN_S(wal_path << ": dropping " << data.size() - wal_size
+                << " torn bytes");
+            VERIFY(truncate(wal_path.c_str(), wal_size) == 0,
+                "failed to truncate log file");
         }
 
-        for (int i = 0; i < n; ++i) {
-            const auto fd = events[i].data.fd;
+        open_log();
+        // the values files and the log may have just been created
+        NCheckpoint::sync_directory(wal_path);
+    }
+};
 
-            if (events[i].events & EPOLLERR
-                    || events[i].events & EPOLLHUP
-                    || !(events[i].events & (EPOLLIN | EPOLLOUT)))
-            {
-                LOG_ERROR_S("epoll event error on fd " << fd);
+////////////////////////////////////////////////////////////////////////////////
 
-                finalize(fd);
+// protocol-independent request, v1 values are moved out of the protobuf,
+// v2 values point into the frame
+struct Request
+{
+    // PUT_REQUEST or GET_REQUEST
+    char type = 0;
+    bool v2 = false;
+    uint64_t request_id = 0;
+    uint32_t priority = PRIORITY_NORMAL;
+    // "" is the default namespace, v2 requests always use it
+    std::string ns;
+    std::string key;
+
+    BufferRef frame;
+    std::string_view frame_value;
+    std::string owned_value;
+
+    std::string_view value() const
+    {
+        return v2 ? frame_value : std::string_view(owned_value);
+    }
+};
 
+// nullopt if the frame is not a TMessage
+template<class TMessage>
+std::optional<TMessage> parse_message(const BufferRef& frame)
+{
+    TMessage message;
+    if (!message.ParseFromArray(frame.data(), frame.size())) {
+        return std::nullopt;
+    }
+
+    return message;
+}
+
+// nullopt for a malformed frame, a protocol error
+std::optional<Request> parse_request(char request_type, const BufferRef& frame)
+{
+    Request request;
+
+    switch (request_type) {
+        case PUT_REQUEST: {
+            auto parsed = parse_message<NProto::TPutRequest>(frame);
+            if (!parsed) {
+                break;
+            }
+            auto& put_request = *parsed;
+            LOG_DEBUG_S("put_request: " << put_request.ShortDebugString());
+
+            request.type = PUT_REQUEST;
+            request.request_id = put_request.request_id();
+            request.priority = put_request.priority();
+            request.ns = std::move(*put_request.mutable_ns());
+            request.key = std::move(*put_request.mutable_key());
+            request.owned_value = std::move(*put_request.mutable_offset());
+            return request;
+        }
+
+        case GET_REQUEST: {
+            auto parsed = parse_message<NProto::TGetRequest>(frame);
+            if (!parsed) {
+                break;
+            }
+            auto& get_request = *parsed;
+            LOG_DEBUG_S("get_request: " << get_request.ShortDebugString());
+
+            request.type = GET_REQUEST;
+            request.request_id = get_request.request_id();
+            request.priority = get_request.priority();
+            request.ns = std::move(*get_request.mutable_ns());
+            request.key = std::move(*get_request.mutable_key());
+            return request;
+        }
+
+        case PUT_REQUEST_V2:
+        case GET_REQUEST_V2:
+        case PUT_REQUEST_K16:
+        case GET_REQUEST_K16: {
+            MessageV2 message;
+            if (!parse_message_v2(request_type, frame.view(), message)) {
+                break;
+            }
+
+            LOG_DEBUG_S("v2 request: type=" << int(request_type)
+                << " request_id=" << message.request_id
+                << " key=" << message.key);
+
+            request.type = request_type == PUT_REQUEST_V2
+                    || request_type == PUT_REQUEST_K16
+                ? PUT_REQUEST
+                : GET_REQUEST;
+            request.v2 = true;
+            request.request_id = message.request_id;
+            request.key = message.key;
+            request.frame = frame;
+            request.frame_value = message.value;
+            return request;
+        }
+    }
+
+    return std::nullopt;
+}
+
+// with KEY_SIZE every key must have exactly that many bytes; a get of any
+// other key simply misses, a put of one is rejected: false, the caller
+// closes the connection
+bool check_key(const ServerEnv& env, const Request& request)
+{
+    if (env.key_size
+            && request.type == PUT_REQUEST
+            && request.key.size() != env.key_size)
+    {
+        LOG_ERROR_S("put of a " << request.key.size()
+            << "-byte key, KEY_SIZE is " << env.key_size);
+        return false;
+    }
+
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+Output put_response(const Request& request)
+{
+    if (request.v2) {
+        return serialize_message_v2(
+            PUT_RESPONSE_V2,
+            MessageV2{request.request_id, {}, {}});
+    }
+
+    NProto::TPutResponse put_response;
+    put_response.set_request_id(request.request_id);
+
+    return serialize_message(PUT_RESPONSE, put_response);
+}
+
+// response carrying a value that is already in memory
+Output value_response(const Request& request, std::string_view value)
+{
+    if (request.v2) {
+        return serialize_message_v2(
+            GET_RESPONSE_V2,
+            MessageV2{request.request_id, {}, value});
+    }
+
+    NProto::TGetResponse get_response;
+    get_response.set_request_id(request.request_id);
+    if (!value.empty()) {
+        get_response.set_offset(std::string(value));
+    }
+
+    return serialize_message(GET_RESPONSE, get_response);
+}
+
+// what a get needs from the values file: values of at least
+// sendfile_threshold bytes stay in the file and are sent with sendfile,
+// smaller ones (or all of them with a 0 threshold) are read into memory
+struct LoadedValue
+{
+    FileRegion region;
+    std::optional<std::string> value;
+};
+
+template<class TKey, class TMutex>
+LoadedValue load_value(
+    BinaryPersistentHashTable<TKey, TMutex>& values,
+    uint64_t offset,
+    size_t sendfile_threshold)
+{
+    LoadedValue loaded;
+    loaded.region = values.region(offset);
+    if (!sendfile_threshold || loaded.region.size < sendfile_threshold) {
+        loaded.value = values.read(offset);
+    }
+
+    return loaded;
+}
+
+// a value left in the file can only be answered over v2
+Output loaded_response(const Request& request, const LoadedValue& loaded)
+{
+    if (loaded.value) {
+        return value_response(request, *loaded.value);
+    }
+
+    return Output(
+        serialize_message_v2(
+            GET_RESPONSE_V2,
+            MessageV2{request.request_id, {}, {}},
+            loaded.region.size),
+        loaded.region);
+}
+
+// reads the value at offset (if any), large v2 values are not read at all:
+// the response carries the value's region of the values file for sendfile
+template<class TKey, class TMutex>
+Output get_response(
+    BinaryPersistentHashTable<TKey, TMutex>& values,
+    const Request& request,
+    std::optional<uint64_t> offset,
+    size_t sendfile_threshold)
+{
+    if (!offset) {
+        return value_response(request, {});
+    }
+
+    return loaded_response(
+        request,
+        load_value(values, *offset, request.v2 ? sendfile_threshold : 0));
+}
+
+Output stats_response(const NProto::TStatsRequest& stats_request)
+{
+    NProto::TStatsResponse stats_response;
+    stats_response.set_request_id(stats_request.request_id());
+    for (const auto& [name, value]: NStats::snapshot()) {
+        (*stats_response.mutable_counters())[name] = value;
+    }
+
+    return serialize_message(STATS_RESPONSE, stats_response);
+}
+
+// a put to an unknown namespace is rejected: false, the caller closes the
+// connection; every shard has the same namespaces
+template<class TKey, class TMutex>
+bool check_namespace(Shard<TKey, TMutex>& shard, const Request& request)
+{
+    if (request.type == PUT_REQUEST && !shard.find(request.ns)) {
+        LOG_ERROR_S("put to an unknown namespace " << request.ns);
+        return false;
+    }
+
+    return true;
+}
+
+// a get of an unknown namespace simply misses, puts never get here
+// (check_namespace)
+Output unknown_namespace_response(const Request& request)
+{
+    return value_response(request, {});
+}
+
+template<class TKey, class TMutex>
+Output handle_request(
+    Shard<TKey, TMutex>& shard,
+    const ServerEnv& env,
+    const Request& request)
+{
+    auto* space = shard.find(request.ns);
+    if (!space) {
+        return unknown_namespace_response(request);
+    }
+
+    auto& values = space->values;
+    if (request.type == PUT_REQUEST) {
+        ::puts_counter.add(1);
+        values.stage(request.key, request.value());
+        return put_response(request);
+    }
+
+    ::gets_counter.add(1);
+    if (auto staged = values.staged_value(request.key)) {
+        return value_response(request, *staged);
+    }
+
+    return get_response(
+        values,
+        request,
+        values.locate(request.key),
+        env.sendfile_threshold);
+}
+
+// serves a low priority request once the reactor has nothing else to do,
+// the response goes out with the next flush, after the put is written
+template<class TKey, class TMutex>
+void defer_request(
+    Reactor& reactor,
+    Shard<TKey, TMutex>& shard,
+    const ServerEnv& env,
+    SocketStatePtr state,
+    Request request)
+{
+    reactor.defer([&reactor, &shard, &env, state, request] () {
+        reactor.complete(state, handle_request(shard, env, request));
+    });
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// puts whose value is still being appended, i.e. not in the index yet;
+// pipelined gets of these keys are answered from memory so that they do not
+// overtake the put, reactor thread only
+struct InFlightWrites
+{
+    struct Write
+    {
+        // latest put of the key
+        uint64_t seq = 0;
+        // the latest put's value while its append runs, it points into that
+        // put's request, which is alive until then; unset once the put is
+        // in the index (or failed), gets read the index again from there
+        std::optional<std::string_view> value;
+        // latest put whose offset is in the index, 0 if none yet: appends
+        // finish in any order and an older one must not be linked over it
+        uint64_t linked = 0;
+        // puts of the key still appending, the entry goes with the last one
+        size_t puts = 0;
+    };
+
+    uint64_t next_seq = 1;
+    std::unordered_map<std::string, Write> writes;
+};
+
+// gets of a record that is already being read join that read instead of
+// issuing their own, reactor thread only
+struct ReadCoalescer
+{
+    struct Read
+    {
+        LoadedValue loaded;
+        WaitList waiters;
+    };
+
+    // keyed by record offset, a record never changes once written
+    std::unordered_map<uint64_t, std::shared_ptr<Read>> reads;
+};
+
+// everything an async handler needs, owned by one reactor; values,
+// in_flight and coalescer are those of the request's namespace
+template<class TKey, class TMutex>
+struct AsyncContext
+{
+    Reactor& reactor;
+    NExecutor::Executor& executor;
+    BinaryPersistentHashTable<TKey, TMutex>& values;
+    InFlightWrites& in_flight;
+    ReadCoalescer& coalescer;
+    const ServerEnv& env;
+};
+
+// index lookups run on the reactor, value io on the pool, puts are
+// acknowledged only after the log holding the write is flushed
+template<class TKey, class TMutex>
+Task<Output> handle_request_async(
+    AsyncContext<TKey, TMutex> ctx,
+    Request request)
+{
+    const auto priority = request.priority == PRIORITY_LOW
+        ? NExecutor::EPriority::BACKGROUND
+        : NExecutor::EPriority::FOREGROUND;
+
+    if (request.type == PUT_REQUEST) {
+        ::puts_counter.add(1);
+
+        const auto seq = ctx.in_flight.next_seq++;
+        {
+            auto& write = ctx.in_flight.writes[request.key];
+            write.seq = seq;
+            write.value = request.value();
+            ++write.puts;
+        }
+
+        const auto offset = co_await offload(ctx.executor, ctx.reactor, priority, [&] () {
+            return ctx.values.append(request.value());
+        });
+
+        // the entry stays until the last put of the key is done
+        auto it = ctx.in_flight.writes.find(request.key);
+        auto& write = it->second;
+        if (offset && seq > write.linked) {
+            ctx.values.link(request.key, *offset);
+            write.linked = seq;
+        }
+        if (seq == write.seq) {
+            write.value.reset();
+        }
+        if (--write.puts == 0) {
+            ctx.in_flight.writes.erase(it);
+        }
+
+        if (!offset) {
+            LOG_ERROR_S("failed to write a value of " << request.key);
+            co_return Output();
+        }
+
+        co_await flushed(ctx.reactor);
+
+        co_return put_response(request);
+    }
+
+    ::gets_counter.add(1);
+
+    auto it = ctx.in_flight.writes.find(request.key);
+    if (it != ctx.in_flight.writes.end() && it->second.value) {
+        co_return value_response(request, *it->second.value);
+    }
+
+    const auto offset = ctx.values.locate(request.key);
+    if (!offset) {
+        co_return get_response(
+            ctx.values,
+            request,
+            offset,
+            ctx.env.sendfile_threshold);
+    }
+
+    auto& reads = ctx.coalescer.reads;
+    std::shared_ptr<ReadCoalescer::Read> read;
+
+    if (auto r = reads.find(*offset); r != reads.end()) {
+        ::coalesced_gets_counter.add(1);
+
+        read = r->second;
+        co_await read->waiters.wait();
+    } else {
+        ::get_reads_counter.add(1);
+
+        read = std::make_shared<ReadCoalescer::Read>();
+        reads.emplace(*offset, read);
+
+        const auto threshold = request.v2 ? ctx.env.sendfile_threshold : 0;
+        read->loaded = co_await offload(ctx.executor, ctx.reactor, priority, [&] () {
+            return load_value(ctx.values, *offset, threshold);
+        });
+
+        reads.erase(*offset);
+        read->waiters.notify_all();
+    }
+
+    if (!request.v2 && !read->loaded.value) {
+        // joined a v2 read that left a large value in the file
+        co_return co_await offload(ctx.executor, ctx.reactor, priority, [&] () {
+            return get_response(ctx.values, request, offset, 0);
+        });
+    }
+
+    co_return loaded_response(request, read->loaded);
+}
+
+template<class TKey, class TMutex>
+Task<> serve_async(
+    AsyncContext<TKey, TMutex> ctx,
+    SocketStatePtr state,
+    Request request)
+{
+    auto response = co_await handle_request_async(ctx, std::move(request));
+
+    if (!response) {
+        // a failed put is never acknowledged, the client sees the
+        // connection close instead
+        if (state->fd != -1) {
+            ctx.reactor.finalize(state->fd);
+        }
+        co_return;
+    }
+
+    ctx.reactor.complete(state, std::move(response));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// shared by every background writer of the process
+std::unique_ptr<NIoLimit::TokenBucket> make_background_limiter(
+    const ServerEnv& env)
+{
+    auto limiter = std::make_unique<NIoLimit::TokenBucket>(
+        env.background_io_rate,
+        background_io_burst);
+    limiter->enable_tuning(
+        env.background_io_min_rate,
+        env.foreground_read_target_us);
+    return limiter;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// streamed backups go out in chunks of this size, at most
+// backup_queued_chunks of them wait in the connection's output queue
+constexpr size_t backup_chunk_size = 1024 * 1024;
+constexpr size_t backup_queued_chunks = 4;
+
+// index copies of the running backups
+NMemory::Account& backup_memory()
+{
+    static auto* account = new NMemory::Account("backups");
+    return *account;
+}
+
+/*
+ * point-in-time copy of a namespace: every part (the storage, or each shard
+ * in shared-nothing mode) copies its index on its own thread, then a
+ * background thread writes the records the copies point to; the values
+ * files are append-only, so those records stay what they were
+ */
+template<class TKey, class TMutex>
+class Backup: public std::enable_shared_from_this<Backup<TKey, TMutex>>
+{
+private:
+    struct Entry
+    {
+        BinaryPersistentHashTable<TKey, TMutex>* values = nullptr;
+        uint64_t offset = 0;
+        TKey key;
+    };
+
+    Reactor& Origin;
+    const SocketStatePtr State;
+    const NProto::TBackupRequest Request;
+    NIoLimit::TokenBucket* const SharedLimiter;
+
+    std::mutex Mutex;
+    std::vector<Entry> Entries;
+    int PartsLeft = 0;
+    bool UnknownNamespace = false;
+
+    // chunks passed to Origin and those the connection let go of again,
+    // their difference is what is still queued or being sent
+    size_t Handed = 0;
+    size_t Released = 0;
+    bool Closed = false;
+    // signalled by Origin as chunks are released, under Mutex
+    std::condition_variable Drained;
+
+    // buffers of the handed chunks, Origin only: a chunk is released once
+    // neither the reactor nor a zerocopy send holds its buffer
+    std::deque<NPool::BufferRef> Unsent;
+
+public:
+    // answered on origin's thread, the shared limiter is taken unless the
+    // request sets its own rate
+    Backup(
+            Reactor& origin,
+            SocketStatePtr state,
+            NProto::TBackupRequest request,
+            NIoLimit::TokenBucket* limiter,
+            int parts)
+        : Origin(origin)
+        , State(std::move(state))
+        , Request(std::move(request))
+        , SharedLimiter(limiter)
+        , PartsLeft(parts)
+    {
+    }
+
+    ~Backup()
+    {
+        backup_memory().add(-int64_t(Entries.capacity() * sizeof(Entry)));
+    }
+
+    // on the part's own thread: makes the staged writes part of the index
+    // and copies the namespace's index, the last part starts the writer
+    void add(Shard<TKey, TMutex>& shard)
+    {
+        shard.flush();
+
+        std::vector<std::pair<TKey, uint64_t>> snapshot;
+        auto* space = shard.find(Request.ns());
+        if (space) {
+            snapshot = space->table.snapshot();
+        }
+
+        std::lock_guard<std::mutex> guard(Mutex);
+        UnknownNamespace |= !space;
+
+        backup_memory().add(-int64_t(Entries.capacity() * sizeof(Entry)));
+        Entries.reserve(Entries.size() + snapshot.size());
+        backup_memory().add(Entries.capacity() * sizeof(Entry));
+        for (auto& [key, offset]: snapshot) {
+            Entries.push_back({&space->values, offset, std::move(key)});
+        }
+
+        if (--PartsLeft == 0) {
+            std::thread([self = this->shared_from_this()] () {
+                NTopology::make_current_thread_background();
+                self->run();
+            }).detach();
+        }
+    }
+
+private:
+    void run()
+    {
+        NProto::TBackupResponse result;
+        result.set_request_id(Request.request_id());
+        result.set_last(true);
+
+        if (UnknownNamespace) {
+            result.set_error("unknown namespace");
+            respond(result);
+            return;
+        }
+
+        std::unique_ptr<NIoLimit::TokenBucket> own_limiter;
+        auto* limiter = SharedLimiter;
+        if (Request.rate()) {
+            own_limiter = std::make_unique<NIoLimit::TokenBucket>(
+                Request.rate(),
+                backup_chunk_size);
+            limiter = own_limiter.get();
+        }
+
+        const auto& path = Request.path();
+        const auto tmp_path = path + ".tmp";
+        int fd = -1;
+        if (!path.empty()) {
+            fd = open(
+                tmp_path.c_str(),
+                O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                0644);
+            if (fd == -1) {
+                result.set_error("failed to open " + tmp_path);
+                respond(result);
+                return;
+            }
+        }
+
+        // sequential reads of every values file
+        std::sort(Entries.begin(), Entries.end(), [] (auto& l, auto& r) {
+            return std::tie(l.values, l.offset) < std::tie(r.values, r.offset);
+        });
+
+        bool ok = true;
+        uint64_t bytes = 0;
+        std::string chunk;
+        auto emit = [&] () {
+            if (limiter) {
+                limiter->acquire(chunk.size());
+            }
+            bytes += chunk.size();
+            ok &= fd != -1 ? NCodec::write_all(fd, chunk) : send_chunk(chunk);
+            chunk.clear();
+        };
+
+        NSnapshot::write_header(chunk);
+        for (auto& entry: Entries) {
+            NSnapshot::append(
+                chunk,
+                NCodec::key_bytes(entry.key),
+                entry.values->readRecord(entry.offset));
+            if (chunk.size() >= backup_chunk_size) {
+                emit();
+                if (!ok) {
+                    break;
+                }
+            }
+        }
+
+        if (ok) {
+            NSnapshot::write_footer(chunk, Entries.size());
+            emit();
+        }
+
+        if (fd != -1) {
+            ok &= fsync(fd) == 0;
+            close(fd);
+            ok = ok && rename(tmp_path.c_str(), path.c_str()) == 0;
+            if (!ok) {
+                unlink(tmp_path.c_str());
+            }
+        }
+
+        result.set_records(Entries.size());
+        result.set_bytes(bytes);
+        if (!ok) {
+            result.set_error("failed to write the backup");
+        }
+
+        LOG_INFO_S("backup of namespace '" << Request.ns() << "' "
+            << (ok ? "done" : "failed") << ", "
+            << Entries.size() << " records, " << bytes << " bytes");
+        respond(result);
+    }
+
+    // false once the connection is gone
+    bool send_chunk(std::string& chunk)
+    {
+        {
+            std::unique_lock<std::mutex> guard(Mutex);
+            if (Handed - Released >= backup_queued_chunks && !Closed) {
+                Origin.schedule([self = this->shared_from_this()] () {
+                    self->watch_output();
+                });
+                Drained.wait(guard, [this] () {
+                    return Handed - Released < backup_queued_chunks || Closed;
+                });
+            }
+
+            if (Closed) {
+                return false;
+            }
+            ++Handed;
+        }
+
+        NProto::TBackupResponse response;
+        response.set_request_id(Request.request_id());
+        response.set_data(std::move(chunk));
+
+        respond(response, true);
+        return true;
+    }
+
+    // on Origin: counts the released chunks, wakes the writer once there is
+    // room and otherwise waits for the connection's next send
+    void watch_output()
+    {
+        size_t released = 0;
+        while (!Unsent.empty() && Unsent.front().unique()) {
+            Unsent.pop_front();
+            ++released;
+        }
+
+        bool full = false;
+        {
+            std::lock_guard<std::mutex> guard(Mutex);
+            Released += released;
+            Closed |= State->fd == -1;
+            full = Handed - Released >= backup_queued_chunks && !Closed;
+        }
+
+        if (full) {
+            State->output_waiters.push_back(
+                [self = this->shared_from_this()] () {
+                    self->watch_output();
+                });
+        } else {
+            Drained.notify_one();
+        }
+    }
+
+    void respond(const NProto::TBackupResponse& response, bool chunk = false)
+    {
+        Output output = serialize_message(BACKUP_RESPONSE, response);
+        Origin.schedule([self = this->shared_from_this(), output, chunk] () {
+            if (chunk) {
+                self->Unsent.push_back(output.buffer);
+            }
+            self->Origin.complete(self->State, output);
+        });
+    }
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+// bulk ingests append values in blocks of this size
+constexpr size_t ingest_block_size = 4 * 1024 * 1024;
+
+// index entries of the running ingests
+NMemory::Account& ingest_memory()
+{
+    static auto* account = new NMemory::Account("ingests");
+    return *account;
+}
+
+// a storage with the reactor that may touch its index: the storage of a
+// shared server, or a shard of a shared-nothing one
+template<class TKey, class TMutex>
+struct StoragePart
+{
+    Reactor* owner = nullptr;
+    Shard<TKey, TMutex>* shard = nullptr;
+};
+
+/*
+ * bulk load of a stream in the backup format (snapshot.h) into a namespace
+ * of a running server: the values go to the end of the values files in
+ * large blocks, next to the regular puts, and the index entries are kept
+ * aside; once the stream is complete and the values are synced, every
+ * part takes its entries under one lock and commits them to its log, so
+ * the whole dataset becomes visible at once, or not at all on an error
+ *
+ * feed and finish run on one thread at a time, the reactor's for a
+ * streamed ingest and a background thread for a file
+ */
+template<class TKey, class TMutex>
+class Ingest: public std::enable_shared_from_this<Ingest<TKey, TMutex>>
+{
+private:
+    struct Target
+    {
+        StoragePart<TKey, TMutex> part;
+        Namespace<TKey, TMutex>* space = nullptr;
+        std::string block;
+        // the offsets of entries[placed...] are relative to block
+        std::vector<std::pair<TKey, uint64_t>> entries;
+        size_t placed = 0;
+    };
+
+    Reactor& Origin;
+    const SocketStatePtr State;
+    std::vector<Target> Targets;
+
+    NSnapshot::Reader Reader;
+    uint64_t InvalidKeys = 0;
+    std::string Error;
+
+    std::atomic<int> PartsLeft = 0;
+    int64_t Charged = 0;
+
+public:
+    Ingest(
+            Reactor& origin,
+            SocketStatePtr state,
+            const std::string& ns,
+            const std::vector<StoragePart<TKey, TMutex>>& parts)
+        : Origin(origin)
+        , State(std::move(state))
+        , Targets(parts.size())
+    {
+        for (size_t i = 0; i < parts.size(); ++i) {
+            Targets[i].part = parts[i];
+            if (!parts[i].shard) {
+                Error = "the server is starting";
                 continue;
             }
 
-            if (socketfd == fd) {
-                while (true) {
-                    auto state = ::accept_connection(socketfd, event, epollfd);
-                    if (!state) {
-                        break;
+            Targets[i].space = parts[i].shard->find(ns);
+            if (!Targets[i].space) {
+                Error = "unknown namespace";
+            }
+        }
+    }
+
+    ~Ingest()
+    {
+        ingest_memory().add(-Charged);
+    }
+
+    // origin's thread
+    bool closed() const
+    {
+        return State->fd == -1;
+    }
+
+    void feed(std::string_view chunk)
+    {
+        if (!Error.empty()) {
+            return;
+        }
+
+        auto load = [&] (const std::string& key, const std::string& value) {
+            if (!is_valid_key<TKey>(key)) {
+                ++InvalidKeys;
+                return;
+            }
+
+            // keys are routed like requests in shared-nothing mode
+            auto& target = Targets.size() == 1
+                ? Targets[0]
+                : Targets[std::hash<std::string>()(key) % Targets.size()];
+            const uint64_t offset = target.block.size();
+            NCodec::Codec<uint64_t>::write(target.block, value.size());
+            target.block.append(value);
+            target.entries.emplace_back(to_key<TKey>(key), offset);
+
+            if (target.block.size() >= ingest_block_size) {
+                write_block(target);
+            }
+        };
+
+        if (!Reader.feed(chunk, load)) {
+            Error = "malformed ingest stream";
+        }
+    }
+
+    void feed_file(const std::string& path)
+    {
+        const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            Error = "failed to open " + path;
+            return;
+        }
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+        std::string chunk(ingest_block_size, 0);
+        while (Error.empty()) {
+            const auto n = read(fd, chunk.data(), chunk.size());
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0) {
+                Error = "failed to read " + path;
+            }
+            if (n <= 0) {
+                break;
+            }
+            feed(std::string_view(chunk.data(), n));
+        }
+
+        close(fd);
+    }
+
+    // the stream is over: writes and syncs the rest of the values, then
+    // publishes the entries and answers request_id with the outcome
+    void finish(uint64_t request_id)
+    {
+        if (Error.empty() && !Reader.complete()) {
+            Error = "incomplete ingest stream";
+        }
+        if (Error.empty() && InvalidKeys) {
+            Error = std::to_string(InvalidKeys) + " keys do not fit KEY_SIZE";
+        }
+
+        for (auto& target: Targets) {
+            if (Error.empty()) {
+                write_block(target);
+            }
+            if (Error.empty() && target.space && !target.space->values.sync()) {
+                Error = "failed to sync the values";
+            }
+        }
+
+        LOG_INFO_S("ingest of " << Reader.records() << " records "
+            << (Error.empty() ? "written" : "failed: " + Error));
+
+        if (!Error.empty()) {
+            respond(request_id);
+            return;
+        }
+
+        PartsLeft = Targets.size();
+        for (size_t i = 0; i < Targets.size(); ++i) {
+            auto& target = Targets[i];
+            target.part.owner->schedule(
+                [self = this->shared_from_this(), &target, request_id] () {
+                    target.space->table.putBatch(target.entries);
+                    target.part.shard->flush();
+
+                    if (--self->PartsLeft == 0) {
+                        self->respond(request_id);
+                    }
+                });
+        }
+    }
+
+private:
+    void write_block(Target& target)
+    {
+        if (target.block.empty()) {
+            return;
+        }
+
+        const auto start = target.space->values.appendBlock(target.block);
+        if (!start) {
+            Error = "failed to write the values";
+            return;
+        }
+
+        for (size_t i = target.placed; i < target.entries.size(); ++i) {
+            target.entries[i].second += *start;
+        }
+        target.placed = target.entries.size();
+        target.block.clear();
+
+        int64_t charged = 0;
+        for (auto& other: Targets) {
+            charged += other.entries.capacity() * sizeof(other.entries[0]);
+        }
+        ingest_memory().add(charged - Charged);
+        Charged = charged;
+    }
+
+    void respond(uint64_t request_id)
+    {
+        NProto::TIngestResponse response;
+        response.set_request_id(request_id);
+        response.set_records(Error.empty() ? Reader.records() : 0);
+        response.set_error(Error);
+
+        Output output = serialize_message(INGEST_RESPONSE, response);
+        Origin.schedule([self = this->shared_from_this(), output] () {
+            self->Origin.complete(self->State, output);
+        });
+    }
+};
+
+// streamed ingests of a reactor by connection and stream id
+template<class TKey, class TMutex>
+using IngestStreams = std::map<
+    std::pair<SocketState*, uint64_t>,
+    std::shared_ptr<Ingest<TKey, TMutex>>>;
+
+// a file ingest runs on its own thread; the chunks of a stream are written
+// as they come, each acknowledged right away, the last one once the
+// dataset is visible
+template<class TKey, class TMutex>
+Output ingest_request(
+    Reactor& reactor,
+    const SocketStatePtr& state,
+    const NProto::TIngestRequest& request,
+    const std::vector<StoragePart<TKey, TMutex>>& parts,
+    IngestStreams<TKey, TMutex>& streams)
+{
+    if (!request.path().empty()) {
+        auto ingest = std::make_shared<Ingest<TKey, TMutex>>(
+            reactor,
+            state,
+            request.ns(),
+            parts);
+        std::thread([ingest, request] () {
+            NTopology::make_current_thread_background();
+            ingest->feed_file(request.path());
+            ingest->finish(request.request_id());
+        }).detach();
+
+        return Output();
+    }
+
+    // streams of closed connections are abandoned
+    std::erase_if(streams, [] (const auto& stream) {
+        return stream.second->closed();
+    });
+
+    const auto key = std::make_pair(state.get(), request.stream());
+    auto it = streams.find(key);
+    if (it == streams.end()) {
+        it = streams.emplace(key, std::make_shared<Ingest<TKey, TMutex>>(
+            reactor,
+            state,
+            request.ns(),
+            parts)).first;
+    }
+
+    auto ingest = it->second;
+    ingest->feed(request.data());
+
+    if (!request.last()) {
+        NProto::TIngestResponse response;
+        response.set_request_id(request.request_id());
+        return serialize_message(INGEST_RESPONSE, response);
+    }
+
+    streams.erase(it);
+    ingest->finish(request.request_id());
+    return Output();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// reported by the "memory_pressure" stat, logged on every change
+std::atomic<NMemory::EPressure> last_pressure = NMemory::EPressure::NONE;
+
+// a reactor relieves memory pressure at most this often
+constexpr auto pressure_relief_interval = std::chrono::milliseconds(100);
+
+// called by every reactor per iteration: under pressure (or with a namespace
+// over its quota) the pending writes are committed early, freeing the staged
+// values and logs, and the buffers cached by the pools are given back; not
+// again while the tracked bytes stay as they were after the last time, e.g.
+// an index above the soft limit by itself, there is nothing more to free
+template<class TKey, class TMutex>
+void relieve_memory_pressure(Shard<TKey, TMutex>& shard)
+{
+    // per reactor
+    thread_local std::chrono::steady_clock::time_point last_relief;
+    thread_local int64_t relieved_bytes = -1;
+
+    const auto pressure = NMemory::pressure();
+
+    const auto last = last_pressure.exchange(pressure);
+    if (last != pressure) {
+        NStats::counter("memory_pressure").set(static_cast<int64_t>(pressure));
+        LOG_WARN_S("memory pressure " << static_cast<int>(last)
+            << " -> " << static_cast<int>(pressure)
+            << ", tracked " << NMemory::total_bytes() << " bytes");
+    }
+
+    bool over_quota = false;
+    for (auto& space: shard.spaces) {
+        over_quota |= space->over_quota();
+    }
+
+    if (pressure == NMemory::EPressure::NONE && !over_quota) {
+        relieved_bytes = -1;
+        return;
+    }
+
+    const auto now = std::chrono::steady_clock::now();
+    if (now - last_relief < pressure_relief_interval
+            || NMemory::total_bytes() == relieved_bytes)
+    {
+        return;
+    }
+
+    shard.flush();
+    NPool::trim_free_lists();
+
+    last_relief = now;
+    relieved_bytes = NMemory::total_bytes();
+}
+
+// with a hard limit the reactors stop reading requests above it
+void set_backpressure(const ServerEnv& env, Reactor& reactor)
+{
+    if (!env.memory_hard_limit) {
+        return;
+    }
+
+    reactor.input_paused = [] () {
+        return NMemory::pressure() == NMemory::EPressure::HARD;
+    };
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+using Reactors = std::vector<std::unique_ptr<Reactor>>;
+
+Reactors make_reactors(const ServerEnv& env)
+{
+    const auto cpus = NTopology::cpu_count();
+
+    Reactors reactors;
+    for (int i = 0; i < env.threads; ++i) {
+        // a single reactor runs in the main thread and is not pinned
+        const auto cpu = env.threads == 1 ? -1 : i % cpus;
+        reactors.push_back(std::make_unique<Reactor>(i, cpu));
+        reactors.back()->zerocopy_threshold = env.zerocopy_threshold;
+        reactors.back()->listening = !env.acceptor;
+        reactors.back()->spin_us = env.spin_us;
+        reactors.back()->busy_poll_us = env.busy_poll_us;
+    }
+
+    return reactors;
+}
+
+// runs every reactor in its own pinned thread, init is called from that
+// thread so that everything it allocates is local to the reactor's node
+int run_reactors(
+    const ServerEnv& env,
+    const std::string& port,
+    Reactors& reactors,
+    const std::function<int(Reactor& reactor)>& init)
+{
+    if (env.acceptor) {
+        std::vector<Reactor*> targets;
+        for (auto& reactor: reactors) {
+            targets.push_back(reactor.get());
+        }
+
+        // the process exits with the reactors, the acceptor is not joined
+        std::thread([&port, targets] () {
+            run_acceptor(port, targets);
+            LOG_ERROR("acceptor failed");
+            abort();
+        }).detach();
+    }
+
+    if (reactors.size() == 1) {
+        NIoLimit::forbid_waiting_on_current_thread();
+        return init(*reactors[0]);
+    }
+
+    std::vector<std::thread> threads;
+    std::vector<int> results(reactors.size(), 0);
+    for (size_t i = 0; i < reactors.size(); ++i) {
+        threads.emplace_back([&, i] () {
+            auto& reactor = *reactors[i];
+            if (!NTopology::pin_current_thread(reactor.cpu)) {
+                LOG_ERROR_S("failed to pin reactor " << i
+                    << " to cpu " << reactor.cpu);
+            }
+
+            LOG_INFO_S("reactor " << i << " on cpu " << reactor.cpu
+                << " (node " << NTopology::numa_node_of_cpu(reactor.cpu)
+                << ")");
+
+            NIoLimit::forbid_waiting_on_current_thread();
+            results[i] = init(reactor);
+        });
+    }
+
+    int result = 0;
+    for (size_t i = 0; i < threads.size(); ++i) {
+        threads[i].join();
+        result = std::max(result, results[i]);
+    }
+
+    return result;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// all reactors share one locked storage, with WORKERS handlers become
+// coroutines whose file io runs on the work-stealing pool, checkpoints on
+// their namespace's own thread
+template<class TKey>
+int run_shared(const ServerEnv& env, const std::string& port)
+{
+    std::unique_ptr<NExecutor::Executor> executor;
+    if (env.workers) {
+        // requests queue behind a worker that sleeps in the limiter, the
+        // throttled checkpoint writes run on threads of their own
+        executor = std::make_unique<NExecutor::Executor>(
+            env.workers,
+            NIoLimit::forbid_waiting_on_current_thread);
+    }
+
+    auto limiter = make_background_limiter(env);
+
+    // with a pool checkpoints are scheduled as background pool tasks
+    Shard<TKey, std::mutex> shard(
+        "",
+        env.namespaces,
+        !executor,
+        limiter.get());
+
+    auto reactors = make_reactors(env);
+    return run_reactors(env, port, reactors, [&] (Reactor& reactor) {
+        reactor.on_flush = [&] () {
+            shard.flush();
+        };
+
+        set_backpressure(env, reactor);
+
+        const bool checkpoints = executor && reactor.index == 0;
+        if (checkpoints) {
+            reactor.timeout_ms = env.min_checkpoint_ms();
+        }
+
+        reactor.on_iteration = [&, checkpoints] () {
+            relieve_memory_pressure(shard);
+
+            if (checkpoints) {
+                const auto now = std::chrono::steady_clock::now();
+                for (auto& space: shard.spaces) {
+                    // not on the executor: a checkpoint would hold a
+                    // worker for as long as the limiter throttles it
+                    if (space->checkpoint_due(now)
+                            && space->start_checkpoint_thread())
+                    {
+                        space->last_checkpoint = now;
                     }
+                }
+            }
+        };
+
+        const std::vector<StoragePart<TKey, std::mutex>> parts = {
+            {&reactor, &shard},
+        };
+        IngestStreams<TKey, std::mutex> ingests;
 
-                    states[state->fd] = state;
+        // per namespace
+        std::vector<InFlightWrites> in_flight(shard.spaces.size());
+        std::vector<ReadCoalescer> coalescer(shard.spaces.size());
+
+        Dispatch dispatch = [&] (
+            const SocketStatePtr& state,
+            char request_type,
+            const BufferRef& request)
+        {
+            // a malformed frame is a protocol error, the connection goes
+            auto reject = [&state, request_type] () {
+                LOG_ERROR_S("malformed request of type " << int(request_type));
+                state->rejected = true;
+                return Output();
+            };
+
+            if (request_type == STATS_REQUEST) {
+                auto stats_request =
+                    parse_message<NProto::TStatsRequest>(request);
+                return stats_request
+                    ? stats_response(*stats_request)
+                    : reject();
+            }
+
+            if (request_type == BACKUP_REQUEST) {
+                auto backup_request =
+                    parse_message<NProto::TBackupRequest>(request);
+                if (!backup_request) {
+                    return reject();
                 }
 
-                continue;
+                auto backup = std::make_shared<Backup<TKey, std::mutex>>(
+                    reactor,
+                    state,
+                    std::move(*backup_request),
+                    limiter.get(),
+                    1);
+                backup->add(shard);
+                return Output();
             }
 
-            bool closed = false;
-            if (events[i].events & EPOLLIN) {
-                auto state = states.at(fd);
-                if (!process_input(*state, handler)) {
-                    finalize(fd);
-                    closed = true;
+            if (request_type == INGEST_REQUEST) {
+                auto ingest = parse_message<NProto::TIngestRequest>(request);
+                if (!ingest) {
+                    return reject();
                 }
+
+                return ingest_request(
+                    reactor,
+                    state,
+                    *ingest,
+                    parts,
+                    ingests);
             }
 
-            st.dropLogs();
+            auto result = parse_request(request_type, request);
+            if (!result) {
+                return reject();
+            }
+            auto& parsed = *result;
+            if (!check_key(env, parsed) || !check_namespace(shard, parsed)) {
+                state->rejected = true;
+                return Output();
+            }
 
-            if (events[i].events & EPOLLOUT && !closed) {
-                auto state = states.at(fd);
-                if (!process_output(*state)) {
-                    finalize(fd);
+            if (executor) {
+                auto* space = shard.find(parsed.ns);
+                if (!space) {
+                    return unknown_namespace_response(parsed);
                 }
+
+                // low priority requests are not deferred here, their io
+                // goes to the pool's background queue instead
+                spawn(serve_async(
+                    AsyncContext<TKey, std::mutex>{
+                        reactor,
+                        *executor,
+                        space->values,
+                        in_flight[space->index],
+                        coalescer[space->index],
+                        env},
+                    state,
+                    std::move(parsed)));
+
+                return Output();
             }
-        }
+
+            if (parsed.priority != PRIORITY_LOW) {
+                return handle_request(shard, env, parsed);
+            }
+
+            defer_request(reactor, shard, env, state, std::move(parsed));
+
+            return Output();
+        };
+
+        return reactor.run(port, dispatch);
+    });
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// request travelling to the shard owner and its response travelling back
+struct Forward
+{
+    SocketStatePtr state;
+    int origin = 0;
+    Request request;
+    Output response;
+};
+
+// every reactor owns the keys hashed to it, with its own index, log and
+// value files; other reactors forward such requests over spsc queues, so
+// neither the storage nor the queues take locks
+template<class TKey>
+int run_shared_nothing(const ServerEnv& env, const std::string& port)
+{
+    const int n = env.threads;
+
+    auto reactors = make_reactors(env);
+
+    // mesh[from * n + to] carries requests and responses from -> to
+    std::vector<std::unique_ptr<SpscQueue<Forward>>> mesh;
+    for (int i = 0; i < n * n; ++i) {
+        mesh.push_back(std::make_unique<SpscQueue<Forward>>(
+            ::forward_queue_size));
     }
 
-    LOG_INFO("exiting");
+    auto limiter = make_background_limiter(env);
+
+    // shards[i] is set by reactor i once it is constructed, only its spaces
+    // (find) may be used by other threads
+    std::vector<std::atomic<Shard<TKey, NoopMutex>*>> shards(n);
+
+    return run_reactors(env, port, reactors, [&] (Reactor& reactor) {
+        const int self = reactor.index;
+
+        Shard<TKey, NoopMutex> shard(
+            "shard" + std::to_string(self) + ".",
+            env.namespaces,
+            false,
+            limiter.get());
+        shards[self] = &shard;
+
+        IngestStreams<TKey, NoopMutex> ingests;
+
+        // forwards that did not fit into a full queue
+        std::vector<std::deque<Forward>> backlog(n);
+        std::vector<bool> wakeup(n, false);
+
+        auto send = [&] (int to, Forward forward) {
+            auto& queue = *mesh[self * n + to];
+            if (!backlog[to].empty() || !queue.try_push(std::move(forward))) {
+                backlog[to].push_back(std::move(forward));
+            }
+
+            wakeup[to] = true;
+        };
+
+        std::vector<Forward> answered;
+
+        reactor.on_wakeup = [&] () {
+            Forward forward;
+            for (int from = 0; from < n; ++from) {
+                auto& queue = *mesh[from * n + self];
+                while (queue.try_pop(forward)) {
+                    if (forward.origin == self) {
+                        reactor.complete(
+                            forward.state,
+                            std::move(forward.response));
+                        continue;
+                    }
+
+                    // forwarded requests are served right away whatever
+                    // their priority, the origin is already waiting
+                    forward.response = handle_request(
+                        shard,
+                        env,
+                        forward.request);
+                    forward.request = Request();
+                    answered.push_back(std::move(forward));
+                }
+            }
+
+            if (answered.empty()) {
+                return;
+            }
+
+            // forwarded writes are durable before they are acknowledged
+            shard.flush();
+
+            for (auto& forward: answered) {
+                send(forward.origin, std::move(forward));
+            }
+            answered.clear();
+        };
+
+        reactor.on_flush = [&] () {
+            shard.flush();
+        };
+
+        set_backpressure(env, reactor);
+
+        reactor.on_iteration = [&] () {
+            relieve_memory_pressure(shard);
 
-    close(socketfd);
+            bool blocked = false;
+            for (int to = 0; to < n; ++to) {
+                auto& queue = *mesh[self * n + to];
+                while (!backlog[to].empty()
+                        && queue.try_push(std::move(backlog[to].front())))
+                {
+                    backlog[to].pop_front();
+                }
+
+                blocked |= !backlog[to].empty();
+
+                if (wakeup[to]) {
+                    reactors[to]->wakeup();
+                    wakeup[to] = !backlog[to].empty();
+                }
+            }
+
+            // retry soon while a peer's queue is full
+            reactor.timeout_ms = blocked ? 1 : env.min_checkpoint_ms();
+
+            const auto now = std::chrono::steady_clock::now();
+            for (auto& space: shard.spaces) {
+                if (space->checkpoint_due(now)
+                        && space->start_checkpoint_thread())
+                {
+                    space->last_checkpoint = now;
+                }
+            }
+        };
+
+        reactor.timeout_ms = env.min_checkpoint_ms();
+
+        Dispatch dispatch = [&] (
+            const SocketStatePtr& state,
+            char request_type,
+            const BufferRef& request)
+        {
+            // a malformed frame is a protocol error, the connection goes
+            auto reject = [&state, request_type] () {
+                LOG_ERROR_S("malformed request of type " << int(request_type));
+                state->rejected = true;
+                return Output();
+            };
+
+            if (request_type == STATS_REQUEST) {
+                auto stats_request =
+                    parse_message<NProto::TStatsRequest>(request);
+                return stats_request
+                    ? stats_response(*stats_request)
+                    : reject();
+            }
+
+            // every shard copies its part as soon as its reactor gets to it
+            if (request_type == BACKUP_REQUEST) {
+                auto backup_request =
+                    parse_message<NProto::TBackupRequest>(request);
+                if (!backup_request) {
+                    return reject();
+                }
+
+                auto backup = std::make_shared<Backup<TKey, NoopMutex>>(
+                    reactor,
+                    state,
+                    std::move(*backup_request),
+                    limiter.get(),
+                    n);
+                for (int i = 0; i < n; ++i) {
+                    reactors[i]->schedule([backup, &shards, i] () {
+                        backup->add(*shards[i].load());
+                    });
+                }
+                return Output();
+            }
+
+            if (request_type == INGEST_REQUEST) {
+                auto ingest = parse_message<NProto::TIngestRequest>(request);
+                if (!ingest) {
+                    return reject();
+                }
+
+                std::vector<StoragePart<TKey, NoopMutex>> parts;
+                for (int i = 0; i < n; ++i) {
+                    parts.push_back({reactors[i].get(), shards[i].load()});
+                }
+
+                return ingest_request(
+                    reactor,
+                    state,
+                    *ingest,
+                    parts,
+                    ingests);
+            }
+
+            auto result = parse_request(request_type, request);
+            if (!result) {
+                return reject();
+            }
+            auto& parsed = *result;
+            if (!check_key(env, parsed) || !check_namespace(shard, parsed)) {
+                state->rejected = true;
+                return Output();
+            }
+            const int owner = std::hash<std::string>()(parsed.key) % n;
+            if (owner != self) {
+                send(owner, Forward{state, self, std::move(parsed), {}});
+                return Output();
+            }
+
+            if (parsed.priority != PRIORITY_LOW) {
+                return handle_request(shard, env, parsed);
+            }
+
+            defer_request(reactor, shard, env, state, std::move(parsed));
+
+            return Output();
+        };
+
+        return reactor.run(port, dispatch);
+    });
+}
+
+}   // namespace
+
+////////////////////////////////////////////////////////////////////////////////
+
+int main(int argc, const char** argv)
+{
+    if (argc < 2) {
+        return 1;
+    }
+
+    const ServerEnv env;
+    const std::string port = argv[1];
+
+    if (access(NCheckpoint::convert_journal, F_OK) == 0) {
+        LOG_ERROR_S("an interrupted kvtool convert, run kvtool to finish it");
+        return 1;
+    }
+
+    NMemory::set_limits(env.memory_soft_limit, env.memory_hard_limit);
+
+    if (env.key_size) {
+        switch (env.mode) {
+            case EServerMode::SHARED:
+                return ::run_shared<NCodec::Key16>(env, port);
+            case EServerMode::SHARED_NOTHING:
+                return ::run_shared_nothing<NCodec::Key16>(env, port);
+        }
+    }
+
+    switch (env.mode) {
+        case EServerMode::SHARED:
+            return ::run_shared<std::string>(env, port);
+        case EServerMode::SHARED_NOTHING:
+            return ::run_shared_nothing<std::string>(env, port);
+    }
 
-    return 0;
+    return 1;
 }
@@ -0,0 +1,26 @@
+#include "snapshot.h"
+
+namespace NSnapshot {
+
+////////////////////////////////////////////////////////////////////////////////
+
+void write_header(std::string& out)
+{
+    out.append(header);
+}
+
+void append(std::string& out, std::string_view key, std::string_view value)
+{
+    NCodec::Codec<uint32_t>::write(out, key.size());
+    out.append(key);
+    NCodec::Codec<uint32_t>::write(out, value.size());
+    out.append(value);
+}
+
+void write_footer(std::string& out, uint64_t records)
+{
+    out.append(footer);
+    NCodec::Codec<uint64_t>::write(out, records);
+}
+
+}   // namespace NSnapshot
@@ -0,0 +1,110 @@
+#pragma once
+
+#include "codec.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+namespace NSnapshot {
+
+////////////////////////////////////////////////////////////////////////////////
+
+/*
+ * backup stream of one namespace:
+ * header (8 bytes) key value key value ... footer (8 bytes) record count (8)
+ * keys and values are NCodec strings, keys are the request key bytes
+ * whatever the server's KEY_SIZE; a stream without the footer is incomplete
+ */
+
+constexpr std::string_view header = "KVSNAP01";
+constexpr std::string_view footer = "KVSNAPND";
+
+void write_header(std::string& out);
+void append(std::string& out, std::string_view key, std::string_view value);
+void write_footer(std::string& out, uint64_t records);
+
+// parses a backup stream fed in chunks of any size
+class Reader
+{
+private:
+    std::string Pending;
+    bool HeaderSeen = false;
+    bool Complete = false;
+    bool Failed = false;
+    uint64_t Records = 0;
+
+public:
+    // calls func(key, value) for every record completed by chunk, false once
+    // the stream turns out to be malformed
+    template <typename TFunc>
+    bool feed(std::string_view chunk, TFunc&& func)
+    {
+        if (Failed || (Complete && !chunk.empty())) {
+            Failed = true;
+            return false;
+        }
+
+        Pending.append(chunk);
+        std::string_view in = Pending;
+
+        if (!HeaderSeen) {
+            if (in.size() < header.size()) {
+                return true;
+            }
+            if (in.substr(0, header.size()) != header) {
+                Failed = true;
+                return false;
+            }
+            in.remove_prefix(header.size());
+            HeaderSeen = true;
+        }
+
+        std::string key;
+        std::string value;
+        while (!in.empty()) {
+            // a record's key length never spells the footer
+            const auto n = std::min(in.size(), footer.size());
+            if (in.substr(0, n) == footer.substr(0, n)) {
+                uint64_t records = 0;
+                if (in.size() < footer.size() + sizeof(records)) {
+                    break;
+                }
+
+                memcpy(&records, in.data() + footer.size(), sizeof(records));
+                in.remove_prefix(footer.size() + sizeof(records));
+                Complete = records == Records && in.empty();
+                Failed = !Complete;
+                break;
+            }
+
+            auto rest = in;
+            if (!NCodec::Codec<std::string>::read(rest, key)
+                    || !NCodec::Codec<std::string>::read(rest, value))
+            {
+                break;
+            }
+
+            func(key, value);
+            ++Records;
+            in = rest;
+        }
+
+        Pending.erase(0, Pending.size() - in.size());
+        return !Failed;
+    }
+
+    bool complete() const
+    {
+        return Complete;
+    }
+
+    uint64_t records() const
+    {
+        return Records;
+    }
+};
+
+}   // namespace NSnapshot
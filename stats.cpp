@@ -0,0 +1,55 @@
+#include "stats.h"
+
+#include <map>
+#include <memory>
+#include <mutex>
+
+namespace NStats {
+
+namespace {
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct Registry
+{
+    std::mutex mutex;
+    std::map<std::string, std::unique_ptr<Counter>> counters;
+};
+
+Registry& registry()
+{
+    static auto* r = new Registry();
+    return *r;
+}
+
+}   // namespace
+
+////////////////////////////////////////////////////////////////////////////////
+
+Counter& counter(const std::string& name)
+{
+    auto& r = registry();
+    std::lock_guard<std::mutex> guard(r.mutex);
+
+    auto& c = r.counters[name];
+    if (!c) {
+        c = std::make_unique<Counter>();
+    }
+
+    return *c;
+}
+
+std::vector<std::pair<std::string, int64_t>> snapshot()
+{
+    auto& r = registry();
+    std::lock_guard<std::mutex> guard(r.mutex);
+
+    std::vector<std::pair<std::string, int64_t>> result;
+    for (const auto& [name, c]: r.counters) {
+        result.emplace_back(name, c->get());
+    }
+
+    return result;
+}
+
+}   // namespace NStats
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace NStats {
+
+////////////////////////////////////////////////////////////////////////////////
+
+// process-wide named value, cheap to update from any thread
+class Counter
+{
+private:
+    std::atomic<int64_t> Value{0};
+
+public:
+    void add(int64_t delta)
+    {
+        Value.fetch_add(delta, std::memory_order_relaxed);
+    }
+
+    // for gauges, e.g. a current rate
+    void set(int64_t value)
+    {
+        Value.store(value, std::memory_order_relaxed);
+    }
+
+    int64_t get() const
+    {
+        return Value.load(std::memory_order_relaxed);
+    }
+};
+
+// registers the counter on first use, the reference stays valid forever,
+// callers keep it in a static to skip the lookup
+Counter& counter(const std::string& name);
+
+// name -> value of every registered counter, sorted by name
+std::vector<std::pair<std::string, int64_t>> snapshot();
+
+}   // namespace NStats
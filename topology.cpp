@@ -0,0 +1,84 @@
+#include "topology.h"
+
+#include <cstdlib>
+#include <string>
+
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+namespace NTopology {
+
+namespace {
+
+////////////////////////////////////////////////////////////////////////////////
+
+constexpr int background_nice = 10;
+
+}   // namespace
+
+////////////////////////////////////////////////////////////////////////////////
+
+int cpu_count()
+{
+    auto n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? static_cast<int>(n) : 1;
+}
+
+int numa_node_of_cpu(int cpu)
+{
+    // /sys/devices/system/cpu/cpuN contains a nodeM symlink on numa kernels
+    auto path = "/sys/devices/system/cpu/cpu" + std::to_string(cpu);
+    DIR* dir = opendir(path.c_str());
+    if (!dir) {
+        return 0;
+    }
+
+    int node = 0;
+    while (auto entry = readdir(dir)) {
+        std::string name = entry->d_name;
+        if (name.size() > 4 && name.compare(0, 4, "node") == 0) {
+            node = atoi(name.c_str() + 4);
+            break;
+        }
+    }
+
+    closedir(dir);
+    return node;
+}
+
+bool pin_current_thread(int cpu)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+int current_cpu()
+{
+    return sched_getcpu();
+}
+
+bool make_current_thread_background()
+{
+    // linux applies nice and ioprio per thread when given a tid
+    const auto tid = static_cast<id_t>(syscall(SYS_gettid));
+    const bool nice_ok = setpriority(PRIO_PROCESS, tid, background_nice) == 0;
+
+    // IOPRIO_PRIO_VALUE(IOPRIO_CLASS_BE, 7), no glibc wrapper
+    constexpr int ioprio_who_process = 1;
+    constexpr int ioprio_class_be = 2;
+    constexpr int ioprio_class_shift = 13;
+    const int ioprio = (ioprio_class_be << ioprio_class_shift) | 7;
+    const bool ioprio_ok =
+        syscall(SYS_ioprio_set, ioprio_who_process, tid, ioprio) == 0;
+
+    return nice_ok && ioprio_ok;
+}
+
+}   // namespace NTopology
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <string>
+
+namespace NTopology {
+
+////////////////////////////////////////////////////////////////////////////////
+
+// number of online cpus, at least 1
+int cpu_count();
+
+// numa node owning the cpu, 0 if the topology is unknown (non-numa hosts)
+int numa_node_of_cpu(int cpu);
+
+// binds the calling thread to a single cpu; after this call memory first
+// touched by the thread is placed on that cpu's numa node by the kernel
+bool pin_current_thread(int cpu);
+
+// cpu the calling thread is currently running on, -1 on failure
+int current_cpu();
+
+// lowers the calling thread's cpu (nice) and io (best-effort, lowest level)
+// priority so that it yields to request handling threads
+bool make_current_thread_background();
+
+}   // namespace NTopology